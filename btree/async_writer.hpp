@@ -0,0 +1,394 @@
+#ifndef __ASYNC_WRITER_HPP__
+#define __ASYNC_WRITER_HPP__
+
+#include "page_store.hpp"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Writes batches of pages to a page_store in the background. A batch is
+// sorted by file position and pages that are adjacent on disk go out as one
+// vectored write. io_uring is used when the kernel allows it, otherwise a
+// few pwritev workers take the writes.
+class async_writer
+{
+public:
+    struct page
+    {
+        uint32_t id;
+        const void *buf;
+        size_t len; // up to the page size, the rest of the page is written as zeros
+    };
+
+    async_writer(page_store &store, unsigned queue_depth = 128, size_t num_workers = 4)
+        : store(store), zeros(store.page_size(), 0)
+    {
+        if (!setup_ring(queue_depth))
+        {
+            for (size_t i = 0; i < num_workers; ++i)
+            {
+                workers.emplace_back(&async_writer::work, this);
+            }
+        }
+    }
+
+    ~async_writer()
+    {
+        drain();
+        if (ring_fd >= 0)
+        {
+            munmap(sq_ptr, sq_sz);
+            if (cq_ptr != sq_ptr)
+            {
+                munmap(cq_ptr, cq_sz);
+            }
+            munmap(sqes, sqes_sz);
+            close(ring_fd);
+            return;
+        }
+        {
+            std::unique_lock lock(queue_mutex);
+            stop = true;
+        }
+        queue_cv.notify_all();
+        for (auto &t : workers)
+        {
+            t.join();
+        }
+    }
+
+    bool uses_io_uring() const
+    {
+        return ring_fd >= 0;
+    }
+
+    // start writing every page; the buffers must stay untouched until
+    // drain() returns, and a page must not be submitted again before that
+    void submit(std::vector<page> &pages)
+    {
+        drain();
+        ++nbatches;
+        iovs.clear();
+        runs.clear();
+        for (auto &p : pages)
+        {
+            // with shadow paging the batch goes to consecutive fresh slots
+            store.relocate(p.id);
+        }
+        std::sort(pages.begin(), pages.end(), [&](const page &a, const page &b) {
+            int fa = store.fd_of(a.id), fb = store.fd_of(b.id);
+            return fa != fb ? fa < fb : store.offset(a.id) < store.offset(b.id);
+        });
+        size_t page_sz = store.page_size();
+        iovs.reserve(2 * pages.size());
+        for (auto &p : pages)
+        {
+            int fd = store.fd_of(p.id);
+            off_t off = store.offset(p.id);
+            run *last = runs.empty() ? nullptr : &runs.back();
+            if (last == nullptr || last->fd != fd || last->off + (off_t)last->bytes != off || last->cnt + 2 > IOV_MAX)
+            {
+                runs.push_back(run{fd, off, iovs.size(), 0, 0});
+                last = &runs.back();
+            }
+            iovs.push_back(iovec{const_cast<void *>(p.buf), p.len});
+            ++last->cnt;
+            if (p.len < page_sz)
+            {
+                iovs.push_back(iovec{zeros.data(), page_sz - p.len});
+                ++last->cnt;
+            }
+            last->bytes += page_sz;
+        }
+        if (ring_fd >= 0)
+        {
+            for (size_t i = 0; i < runs.size(); ++i)
+            {
+                push_sqe(i);
+            }
+            enter(to_submit, 0);
+            return;
+        }
+        {
+            std::unique_lock lock(queue_mutex);
+            pending += runs.size();
+            for (size_t i = 0; i < runs.size(); ++i)
+            {
+                queue.push_back(i);
+            }
+        }
+        queue_cv.notify_all();
+    }
+
+    // wait until every submitted write is done
+    void drain()
+    {
+        if (ring_fd >= 0)
+        {
+            while (inflight > 0)
+            {
+                reap(1);
+            }
+            return;
+        }
+        std::unique_lock lock(queue_mutex);
+        done_cv.wait(lock, [&] { return pending == 0; });
+    }
+
+    uint64_t batches() const
+    {
+        return nbatches;
+    }
+
+private:
+    // pages adjacent in one file, written by one vectored write
+    struct run
+    {
+        int fd;
+        off_t off;
+        size_t first; // index of the first iovec
+        size_t cnt;
+        size_t bytes;
+    };
+
+    page_store &store;
+    std::vector<char> zeros; // page padding
+    std::vector<iovec> iovs;
+    std::vector<run> runs;
+    uint64_t nbatches = 0;
+
+    // io_uring state, ring_fd < 0 when the worker fallback is used
+    int ring_fd = -1;
+    void *sq_ptr = nullptr, *cq_ptr = nullptr;
+    size_t sq_sz = 0, cq_sz = 0, sqes_sz = 0;
+    io_uring_sqe *sqes = nullptr;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_cqe *cqes;
+    unsigned to_submit = 0;
+    size_t inflight = 0;
+
+    // worker fallback
+    std::vector<std::thread> workers;
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv, done_cv;
+    std::deque<size_t> queue;
+    size_t pending = 0;
+    bool stop = false;
+
+    bool setup_ring(unsigned entries)
+    {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        int fd = syscall(__NR_io_uring_setup, entries, &p);
+        if (fd < 0)
+        {
+            return false;
+        }
+        sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+        {
+            sq_sz = cq_sz = std::max(sq_sz, cq_sz);
+        }
+        sq_ptr = mmap(nullptr, sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED)
+        {
+            close(fd);
+            return false;
+        }
+        cq_ptr = sq_ptr;
+        if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+        {
+            cq_ptr = mmap(nullptr, cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cq_ptr == MAP_FAILED)
+            {
+                munmap(sq_ptr, sq_sz);
+                close(fd);
+                return false;
+            }
+        }
+        sqes_sz = p.sq_entries * sizeof(io_uring_sqe);
+        void *s = mmap(nullptr, sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (s == MAP_FAILED)
+        {
+            munmap(sq_ptr, sq_sz);
+            if (cq_ptr != sq_ptr)
+            {
+                munmap(cq_ptr, cq_sz);
+            }
+            close(fd);
+            return false;
+        }
+        sqes = static_cast<io_uring_sqe *>(s);
+        char *sq = static_cast<char *>(sq_ptr), *cq = static_cast<char *>(cq_ptr);
+        sq_head = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+        sq_entries = p.sq_entries;
+        cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+        ring_fd = fd;
+        return true;
+    }
+
+    void enter(unsigned submit, unsigned min_complete)
+    {
+        while (true)
+        {
+            int n = syscall(__NR_io_uring_enter, ring_fd, submit, min_complete,
+                            min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (n >= 0)
+            {
+                to_submit -= n;
+                return;
+            }
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            {
+                fprintf(stderr, "async_writer: I/O error in io_uring_enter\n");
+                abort();
+            }
+            if (errno != EINTR)
+            {
+                // out of resources, let some completions arrive first
+                min_complete = inflight > to_submit ? 1 : 0;
+            }
+        }
+    }
+
+    void push_sqe(size_t i)
+    {
+        // the queue never holds more than sq_entries writes
+        while (inflight == sq_entries)
+        {
+            reap(1);
+        }
+        unsigned tail = __atomic_load_n(sq_tail, __ATOMIC_RELAXED);
+        unsigned idx = tail & *sq_mask;
+        io_uring_sqe *sqe = &sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = runs[i].fd;
+        sqe->off = runs[i].off;
+        sqe->addr = (uint64_t)(uintptr_t)&iovs[runs[i].first];
+        sqe->len = runs[i].cnt;
+        sqe->user_data = i;
+        sq_array[idx] = idx;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ++to_submit;
+        ++inflight;
+    }
+
+    // submit what is queued and handle completions, waiting for at least min_complete
+    void reap(unsigned min_complete)
+    {
+        unsigned head = __atomic_load_n(cq_head, __ATOMIC_RELAXED);
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) || to_submit > 0)
+        {
+            enter(to_submit, min_complete);
+        }
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+        {
+            io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            run &r = runs[cqe->user_data];
+            if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EINTR)
+            {
+                fprintf(stderr, "async_writer: I/O error in write\n");
+                abort();
+            }
+            if ((size_t)std::max(cqe->res, 0) < r.bytes)
+            {
+                // short write, finish the rest here
+                write_run(r, std::max(cqe->res, 0));
+            }
+            --inflight;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    // write run r synchronously, skipping the first done bytes
+    void write_run(const run &r, size_t done)
+    {
+        size_t i = r.first, end = r.first + r.cnt;
+        off_t off = r.off + (off_t)done;
+        while (i < end && done >= iovs[i].iov_len)
+        {
+            done -= iovs[i++].iov_len;
+        }
+        for (; i < end; ++i, done = 0)
+        {
+            const char *p = static_cast<const char *>(iovs[i].iov_base) + done;
+            size_t len = iovs[i].iov_len - done;
+            while (len > 0)
+            {
+                ssize_t n = pwrite(r.fd, p, len, off);
+                if (n <= 0)
+                {
+                    fprintf(stderr, "async_writer: I/O error in write\n");
+                    abort();
+                }
+                p += n;
+                off += n;
+                len -= n;
+            }
+        }
+    }
+
+    void work()
+    {
+        while (true)
+        {
+            size_t i;
+            {
+                std::unique_lock lock(queue_mutex);
+                queue_cv.wait(lock, [&] { return stop || !queue.empty(); });
+                if (queue.empty())
+                {
+                    return;
+                }
+                i = queue.front();
+                queue.pop_front();
+            }
+            const run &r = runs[i];
+            ssize_t n = pwritev(r.fd, &iovs[r.first], r.cnt, r.off);
+            if (n < 0 && errno != EINTR && errno != EAGAIN)
+            {
+                fprintf(stderr, "async_writer: I/O error in write\n");
+                abort();
+            }
+            if ((size_t)std::max<ssize_t>(n, 0) < r.bytes)
+            {
+                write_run(r, std::max<ssize_t>(n, 0));
+            }
+            {
+                std::unique_lock lock(queue_mutex);
+                --pending;
+            }
+            done_cv.notify_all();
+        }
+    }
+};
+
+#endif
@@ -1,26 +1,76 @@
 #include "btree_wrapper.hpp"
 
-extern "C" tree_api* create_tree(const tree_options_t& opt)
+// btree specific knobs are not part of tree_options_t, take them from the environment
+static btree_options_t btree_options()
+{
+    btree_options_t bopt;
+    if (const char *s = getenv("BTREE_CACHE_TYPE"))
+        bopt.cache_type = atoi(s);
+    if (const char *s = getenv("BTREE_POOL_MB"))
+        bopt.pool_mb = atol(s);
+    if (const char *s = getenv("BTREE_SCAN_READAHEAD"))
+        bopt.scan_readahead = atoi(s);
+    if (const char *s = getenv("BTREE_WAL"))
+        bopt.use_wal = atoi(s) != 0;
+    if (const char *s = getenv("BTREE_CHECKPOINT_MB"))
+        bopt.checkpoint_mb = atol(s);
+    if (const char *s = getenv("BTREE_BULK_FILL"))
+        bopt.bulk_fill = atof(s);
+    if (const char *s = getenv("BTREE_MERGE_THRESHOLD"))
+        bopt.merge_threshold = atof(s);
+    if (const char *s = getenv("BTREE_MERGE_FILL"))
+        bopt.merge_fill = atof(s);
+    if (const char *s = getenv("BTREE_PAGE_BYTES"))
+        bopt.page_bytes = atol(s);
+    if (const char *s = getenv("BTREE_INNER_IN_MEMORY"))
+        bopt.inner_in_memory = atoi(s) != 0;
+    if (const char *s = getenv("BTREE_SHADOW_PAGING"))
+        bopt.shadow_paging = atoi(s) != 0;
+    if (const char *s = getenv("BTREE_DELTA_UPDATES"))
+        bopt.delta_updates = atoi(s) != 0;
+    if (const char *s = getenv("BTREE_DELTA_CHAIN"))
+        bopt.delta_chain = atoi(s);
+    if (const char *s = getenv("BTREE_LEAF_APPEND"))
+        bopt.leaf_append = atoi(s);
+    if (const char *s = getenv("BTREE_OPEN_EXISTING"))
+        bopt.open_existing = atoi(s) != 0;
+    if (const char *s = getenv("BTREE_HOT_KEYS"))
+        bopt.hot_keys = atol(s);
+    if (const char *s = getenv("BTREE_ADAPTIVE_SPLIT"))
+        bopt.adaptive_split = atoi(s) != 0;
+    if (const char *s = getenv("BTREE_FLUSH_HIGH"))
+        bopt.flush_high = atof(s);
+    if (const char *s = getenv("BTREE_FLUSH_LOW"))
+        bopt.flush_low = atof(s);
+    if (const char *s = getenv("BTREE_FLUSH_MB_PER_SEC"))
+        bopt.flush_mb_per_sec = atol(s);
+    if (const char *s = getenv("BTREE_HUGE_PAGES"))
+        bopt.huge_pages = atoi(s) != 0;
+    return bopt;
+}
+
+template <size_t PageBytes>
+static tree_api* create_btree(const tree_options_t& opt, const btree_options_t& bopt)
 {
     if (opt.key_size == 4)
     {
         if (opt.value_size == 4)
-            return new btree_wrapper<uint32_t, uint32_t>();
+            return new btree_wrapper<uint32_t, uint32_t, PageBytes>(bopt);
         else if (opt.value_size == 8)
-            return new btree_wrapper<uint32_t, uint64_t>();
+            return new btree_wrapper<uint32_t, uint64_t, PageBytes>(bopt);
         else if (opt.value_size > 8)
-            return new btree_wrapper<uint32_t, std::string>();
+            return new btree_wrapper<uint32_t, std::string, PageBytes>(bopt);
         else
             return nullptr;// ERROR
     }
     else if (opt.key_size == 8)
     {
         if (opt.value_size == 4)
-            return new btree_wrapper<uint64_t, uint32_t>();
+            return new btree_wrapper<uint64_t, uint32_t, PageBytes>(bopt);
         else if (opt.value_size == 8)
-            return new btree_wrapper<uint64_t, uint64_t>();
+            return new btree_wrapper<uint64_t, uint64_t, PageBytes>(bopt);
         else if (opt.value_size > 8)
-            return new btree_wrapper<uint64_t, std::string>();
+            return new btree_wrapper<uint64_t, std::string, PageBytes>(bopt);
         else
             return nullptr;// ERROR
 
@@ -28,15 +78,33 @@ extern "C" tree_api* create_tree(const tree_options_t& opt)
     else if (opt.key_size > 8)
     {
         //if (opt.value_size == 4)
-        //    return new btree_wrapper<std::string, uint32_t>();
+        //    return new btree_wrapper<std::string, uint32_t, PageBytes>(bopt);
         //else if (opt.value_size == 8)
-        //    return new btree_wrapper<std::string, uint64_t>();
+        //    return new btree_wrapper<std::string, uint64_t, PageBytes>(bopt);
         //else if (opt.value_size > 8)
-        //    return new btree_wrapper<std::string, std::string>();
+        //    return new btree_wrapper<std::string, std::string, PageBytes>(bopt);
         //else
         //    return nullptr ;// ERROR
 
     }
     else
         return nullptr; // ERROR!
-}
\ No newline at end of file
+}
+
+extern "C" tree_api* create_tree(const tree_options_t& opt)
+{
+    btree_options_t bopt = btree_options();
+    switch (bopt.page_bytes)
+    {
+    case 512:
+        return create_btree<512>(opt, bopt);
+    case 4096:
+        return create_btree<4096>(opt, bopt);
+    case 8192:
+        return create_btree<8192>(opt, bopt);
+    case 16384:
+        return create_btree<16384>(opt, bopt);
+    default:
+        return nullptr; // ERROR
+    }
+}
@@ -2,7 +2,18 @@
 #define __BTREE_WRAPPER_HPP__
 
 #include "tree_api.hpp"
+#include "page_store.hpp"
+#include "page_table.hpp"
+#include "buffer_pool.hpp"
+#include "async_writer.hpp"
+#include "wal.hpp"
+#include "hot_cache.hpp"
+#include "epoch.hpp"
+#include "node_search.hpp"
+#include "../common/page_alloc.hpp"
 
+#include <atomic>
+#include <condition_variable>
 #include <mutex>
 #include <shared_mutex>
 #include <string>
@@ -11,13 +22,42 @@
 #include <algorithm>
 #include <thread>
 #include <list>
+#include <unordered_map>
+#include <memory>
 #include <limits>
+#include <queue>
+#include <type_traits>
 
-template <typename Key, typename T>
+struct btree_options_t
+{
+    uint8_t cache_type = 0; // 0:no, 1:buffer pool, 2: write buffer, 3: mmap of the page files
+    size_t pool_mb = 256;   // buffer pool size for cache_type 1
+    uint32_t scan_readahead = 8; // leaves read ahead of a scan, 0 to disable
+    bool use_wal = false;        // log updates and acknowledge them once durable; implies shadow_paging
+    size_t checkpoint_mb = 64;   // log size that triggers a checkpoint
+    double bulk_fill = 0.9;      // share of every page filled by bulk_load
+    double merge_threshold = 0.25; // pages below this share of capacity are merged, 0 disables
+    double merge_fill = 0.75;      // fullest page a merge may produce, beyond it the pair is evened out
+    size_t page_bytes = 4096;      // page size, one of 512, 4096, 8192, 16384
+    bool inner_in_memory = false;  // keep inner nodes in memory, written to their pages only at checkpoints
+    bool shadow_paging = false;    // never overwrite pages in place, checkpoints switch to the new image atomically
+    bool delta_updates = false;    // updates prepend a delta to the leaf instead of rewriting it
+    uint32_t delta_chain = 8;      // deltas a leaf collects before they are folded into it
+    uint32_t leaf_append = 0;      // inserts a leaf takes unsorted before merging them in, 0 keeps leaves sorted
+    bool open_existing = false;    // start from the tree left in ./btree, replaying its log, instead of a new one
+    size_t hot_keys = 0;           // keys cached in front of find for skewed workloads, 0 disables
+    bool adaptive_split = false;   // pages that grow at their end split unevenly, ascending inserts skip the descent
+    double flush_high = 0;         // share of dirty pool frames that starts the background flusher, 0 disables it
+    double flush_low = 0.1;        // share of dirty pool frames the flusher stops at
+    size_t flush_mb_per_sec = 0;   // write rate of the flusher, 0 for no limit
+    bool huge_pages = false;       // page buffers in 2 MB huge pages; the allocator is shared, so for the whole process
+};
+
+template <typename Key, typename T, size_t PageBytes = 4096>
 class btree_wrapper : public tree_api
 {
 public:
-    btree_wrapper();
+    btree_wrapper(const btree_options_t &opt = btree_options_t());
     virtual ~btree_wrapper();
 
     virtual bool find(const char *key, size_t key_sz, char *value_out) override;
@@ -25,173 +65,262 @@ public:
     virtual bool update(const char *key, size_t key_sz, const char *value, size_t value_sz) override;
     virtual bool remove(const char *key, size_t key_sz) override;
     virtual int scan(const char *key, size_t key_sz, int scan_sz, char *&values_out) override;
-    bool insert(const char *key, size_t key_sz, const char *value, size_t value_sz, size_t lock_mode);
 
-    struct btree_node
+    // build the tree bottom-up from next(key, val), which yields ascending keys
+    // without duplicates, writing pages in order; only on a freshly created
+    // tree and with no other operation running. fill is bulk_fill when <= 0.
+    // returns the number of pairs loaded
+    template <typename F>
+    size_t bulk_load(F &&next, double fill = 0);
+    // same for pairs in any order, sorted first in runs of run_items pairs
+    // that are spilled to disk and merged
+    template <typename F>
+    size_t bulk_load_unsorted(F &&next, size_t run_items = 1 << 22, double fill = 0);
+
+    // page I/O, splits, merges, cache hits and operation latencies so far
+    tree_stats::snapshot stats();
+
+    // B-link layout: every page knows its right sibling on the same level and
+    // the high key bounding its keys from above (unbounded when right is INVALID_PAGE).
+    // both structs occupy exactly one aligned page of PageBytes, allocated
+    // from page_alloc
+    struct alignas(PageBytes) btree_node : slab_allocated<PageBytes>
     {
-        Key key[4096 / (sizeof(Key) + sizeof(uint32_t)) - 1];
-        uint32_t nxt[4096 / (sizeof(Key) + sizeof(uint32_t)) - 1];
+        Key key[(PageBytes - 16) / (sizeof(Key) + sizeof(uint32_t)) - 1];
+        uint32_t nxt[(PageBytes - 16) / (sizeof(Key) + sizeof(uint32_t)) - 1];
         uint32_t num_item;
+        uint32_t level; // 1 for the parents of leaves
+        uint32_t right;
+        Key high_key;
     };
-    struct btree_data
+    struct alignas(PageBytes) btree_data : slab_allocated<PageBytes>
     {
-        Key key[4096 / (sizeof(Key) + sizeof(T)) - 1];
-        T val[4096 / (sizeof(Key) + sizeof(T)) - 1];
+        Key key[(PageBytes - 16) / (sizeof(Key) + sizeof(T)) - 1];
+        T val[(PageBytes - 16) / (sizeof(Key) + sizeof(T)) - 1];
         uint32_t num_item;
+        uint32_t right;
+        Key high_key;
+        uint32_t num_appended; // the last items, in insertion order rather than sorted
     };
+    static_assert(PageBytes >= 512 && (PageBytes & (PageBytes - 1)) == 0, "page size must be a power of two of at least 512");
+    static_assert(sizeof(btree_node) == PageBytes, "btree_node must fill exactly one page");
+    static_assert(sizeof(btree_data) == PageBytes, "btree_data must fill exactly one page");
+
+private:
+    // key: 1   50  100     200     x
+    // nxt: <1  <50 <100    <200    >=200
+    // num_item at least 2 for a btree_node
+    // readers take no page locks and move right past concurrent splits,
+    // writers lock one page per level, child before parent, left before right.
+    // a page merged into its left sibling is marked dead and whoever reaches
+    // it starts over from the root; its id is reused once no operation that
+    // started before the merge is still running
 
-    class LRUCache
+    static constexpr uint32_t INVALID_PAGE = page_store::INVALID_PAGE;
+    static constexpr uint32_t DEAD_PAGE = UINT32_MAX; // num_item of a page merged away
+    static constexpr uint32_t SEQ_SPLIT = 8;          // inserts at the end of a page that make its split uneven
+    uint32_t node_cap = (PageBytes - 16) / (sizeof(Key) + sizeof(uint32_t)) - 1;
+    uint32_t data_cap = (PageBytes - 16) / (sizeof(Key) + sizeof(T)) - 1;
+    tree_stats op_stats;
+    page_store store;
+    // new value of a key of a leaf, prepended to the chain of the page by
+    // update; the chain is folded into the page by the next writer holding
+    // the page lock exclusively, by the consolidator once it is delta_chain
+    // long, or at a checkpoint. Keys with a delta are in the page, as
+    // inserts and removes fold the chain first
+    struct delta
     {
-    public:
-        std::list<std::pair<size_t, btree_node *>> item_list;
-        std::unordered_map<size_t, decltype(item_list.begin())> item_map;
-        size_t cache_size;
-        void clean(void)
+        Key key;
+        T val;
+        delta *next;
+        uint32_t depth; // records in the chain up to this one
+    };
+    // leaf flag, locks, version, in-memory inner node and delta chain of every
+    // page; the version is the seqlock of optimistic readers when there is no
+    // buffer pool
+    page_table<btree_node, delta> pages;
+    std::shared_mutex root_mutex, print_mutex, print_small_mutex;
+    std::atomic<uint32_t> root_id;
+    uint8_t cache_type; // 0:no, 1:buffer pool, 2: write buffer, 3: mmap
+    uint32_t scan_readahead;
+    double bulk_fill;
+    uint32_t data_low, node_low;   // underflow below these
+    uint32_t data_merge, node_merge; // merge up to these
+    // a page id unlinked by a merge, or a delta chain folded into its page;
+    // freed once no operation that could reach it is still running
+    struct garbage
+    {
+        uint32_t page;
+        delta *chain; // the page if null
+    };
+    epoch_reclaimer<garbage> reclaimer;
+    std::unique_ptr<buffer_pool> pool;
+    // write buffer, only for single thread
+    std::unordered_map<uint32_t, btree_node *> node_write_buffer2;
+    std::unordered_map<uint32_t, btree_data *> data_write_buffer2;
+    uint32_t node_buffer_size = 128;
+    // the last full buffer, being written back while inserts go on;
+    // its pages are newer than the disk until the writer is drained
+    std::unique_ptr<async_writer> writer;
+    std::unordered_map<uint32_t, btree_node *> node_flushing;
+    std::unordered_map<uint32_t, btree_data *> data_flushing;
+    // redo log; updates hold checkpoint_mutex shared from their first page
+    // change until their record is appended, a checkpoint holds it exclusively.
+    // The records only redo logical operations, so they need a consistent
+    // image to start from after a crash: the log turns shadow paging on.
+    // With shadow paging updates hold the mutex too, so a checkpoint commits a
+    // consistent image; it is also due once checkpoint_bytes of pages were
+    // superseded
+    std::unique_ptr<wal> log;
+    std::shared_mutex checkpoint_mutex;
+    std::atomic<bool> checkpointing{false};
+    uint64_t checkpoint_bytes;
+    // inner nodes stay in memory as the frames of their descriptors
+    bool inner_in_memory;
+    bool shadow_paging;
+    // ids below it were pages of the tree opened, read in when first needed
+    uint32_t opened_pages = 0;
+    // values of frequently found keys; a change of a key in the tree
+    // updates or drops its entry afterwards
+    std::unique_ptr<hot_cache<Key, T>> hot;
+    // updates of a page share its lock unless a log needs them in order; the
+    // consolidator folds the chains queued when they got long
+    bool delta_updates;
+    uint32_t delta_chain;
+    // inserts append to the leaf and the appended items are merged in once
+    // there are leaf_append of them, before a split and on a merge
+    uint32_t leaf_append;
+    // pages that mostly get inserts at their end split near it; an insert
+    // past the last key of the leaf the last ascending insert went to, and
+    // below its high key, goes there without a descent. The id is kept
+    // while the page lock is held
+    bool adaptive_split;
+    std::atomic<uint32_t> append_leaf{INVALID_PAGE};
+    std::mutex consolidate_mutex;
+    std::condition_variable consolidate_cv;
+    std::vector<uint32_t> consolidate_queue;
+    bool consolidate_stop = false;
+    std::thread consolidator;
+
+    bool is_leaf(uint32_t id)
+    {
+        return pages[id].leaf.load(std::memory_order_acquire);
+    }
+
+    btree_node *mem_node(uint32_t id)
+    {
+        auto &frame = pages[id].frame;
+        btree_node *node = frame.load(std::memory_order_acquire);
+        if (node == nullptr)
         {
-            while (item_map.size() > cache_size)
+            // a page of an opened tree is read when first needed
+            btree_node *fresh = new btree_node;
+            if (id < opened_pages)
             {
-                auto last_it = item_list.end();
-                last_it--;
-                item_map.erase(last_it->first);
-                item_list.pop_back();
+                store.read(id, fresh, sizeof(btree_node));
             }
-        };
-        LRUCache()
-        {
-            cache_size = 32;
-        };
-
-        void put(size_t key, btree_node *val)
-        {
-            auto it = item_map.find(key);
-            if (it != item_map.end())
+            else
             {
-                item_list.erase(it->second);
-                item_map.erase(it);
+                memset(fresh, 0, sizeof(btree_node));
             }
-            item_list.push_front(std::make_pair(key, val));
-            item_map.insert(std::make_pair(key, item_list.begin()));
-            clean();
-        };
-        bool exist(size_t key)
-        {
-            return (item_map.count(key) > 0);
-        };
-        btree_node *get(size_t key)
-        {
-            auto it = item_map.find(key);
-            item_list.splice(item_list.begin(), item_list, it->second);
-            return it->second->second;
-        };
-    };
+            if (frame.compare_exchange_strong(node, fresh, std::memory_order_acq_rel))
+            {
+                node = fresh;
+            }
+            else
+            {
+                delete fresh;
+            }
+        }
+        return node;
+    }
 
-    class LRUCache2
+    // the in-memory image of page id if it is an inner node kept in memory,
+    // or the page itself in the mapping of the page files
+    template <typename P>
+    P *resident(uint32_t id)
     {
-    public:
-        std::list<std::pair<size_t, btree_data *>> item_list;
-        std::unordered_map<size_t, decltype(item_list.begin())> item_map;
-        size_t cache_size;
-        void clean(void)
+        if constexpr (std::is_same<P, btree_node>::value)
         {
-            while (item_map.size() > cache_size)
+            if (inner_in_memory)
             {
-                auto last_it = item_list.end();
-                last_it--;
-                item_map.erase(last_it->first);
-                item_list.pop_back();
+                return mem_node(id);
             }
-        };
-        LRUCache2()
+        }
+        if (cache_type == 3)
         {
-            cache_size = 32;
-        };
+            return reinterpret_cast<P *>(store.page_addr(id));
+        }
+        return nullptr;
+    }
 
-        void put(size_t key, btree_data *val)
+    // write the in-memory inner nodes to their pages; no update may run.
+    // the ones never read since opening are on their pages already
+    void persist_inner_nodes()
+    {
+        for (uint32_t id = 0, n = store.num_pages(); id < n; ++id)
         {
-            auto it = item_map.find(key);
-            if (it != item_map.end())
+            btree_node *node = is_leaf(id) ? nullptr : pages[id].frame.load(std::memory_order_acquire);
+            if (node != nullptr)
             {
-                item_list.erase(it->second);
-                item_map.erase(it);
+                store.write(id, node, sizeof(btree_node));
             }
-            item_list.push_front(std::make_pair(key, val));
-            item_map.insert(std::make_pair(key, item_list.begin()));
-            clean();
-        };
-        bool exist(size_t key)
-        {
-            return (item_map.count(key) > 0);
-        };
-        btree_data *get(size_t key)
-        {
-            auto it = item_map.find(key);
-            item_list.splice(item_list.begin(), item_list, it->second);
-            return it->second->second;
-        };
-    };
-
-private:
-    // key: 1   50  100     200     x
-    // nxt: <1  <50 <100    <200    >=200
-    // num_item at least 2 for a btree_node
-
-    std::shared_mutex mutex_;
-    uint32_t node_cap = 4096 / (sizeof(Key) + sizeof(uint32_t)) - 1;
-    uint32_t data_cap = 4096 / (sizeof(Key) + sizeof(T)) - 1;
-    std::vector<FILE *> nodes;
-    std::vector<bool> is_leaf;
-    std::vector<std::shared_mutex *> small_mutex;
-    std::vector<std::shared_mutex *> large_mutex;
-    std::shared_mutex root_mutex, print_mutex, print_small_mutex;
-    std::shared_mutex new_mutex;
-    uint32_t root_id;
-    // only for single thread
-    uint8_t cache_type = 0; // 0:no, 1:lru, 2: write buffer
-    std::unordered_map<uint32_t, btree_node *> node_write_buffer2;
-    std::unordered_map<uint32_t, btree_data *> data_write_buffer2;
-    LRUCache node_write_buffer1;
-    LRUCache2 data_write_buffer1;
-    uint32_t node_buffer_size = 128;
+        }
+    }
 
     btree_node *get_node(uint32_t id)
     {
         btree_node *node = new btree_node;
-        if (cache_type == 2)
+        if (inner_in_memory)
         {
-            if (node_write_buffer2.count(id))
-            {
-                memcpy(node, node_write_buffer2[id], sizeof(btree_node));
-                return node;
-            }
+            std::shared_lock lock(pages[id].latch);
+            memcpy(node, mem_node(id), sizeof(btree_node));
+            return node;
         }
-        else if (cache_type == 1)
+        if (cache_type == 2)
         {
-            if (node_write_buffer1.exist(id))
+            auto it = node_write_buffer2.find(id);
+            if (it != node_write_buffer2.end() || (it = node_flushing.find(id)) != node_flushing.end())
             {
-                memcpy(node, node_write_buffer1.get(id), sizeof(btree_node));
+                op_stats.add(tree_stats::CACHE_HITS);
+                memcpy(node, it->second, sizeof(btree_node));
                 return node;
             }
+            op_stats.add(tree_stats::CACHE_MISSES);
         }
-        size_t state;
-        {
-            std::unique_lock lock(*small_mutex[id]);
-            rewind(nodes[id]);
-            state = fread(node, sizeof(btree_node), 1, nodes[id]);
-        }
-        if (state != 1)
+        else if (cache_type == 1)
         {
-            fprintf(stderr, "btree: I/O error in get_node\n");
-            abort();
+            auto f = pool->pin_shared(id);
+            memcpy(node, f->data, sizeof(btree_node));
+            pool->unpin_shared(f);
+            return node;
         }
+        store.read(id, node, sizeof(btree_node));
 
         return node;
     }
 
     void set_node(uint32_t id, btree_node *node)
     {
+        if (inner_in_memory)
+        {
+            {
+                std::unique_lock lock(pages[id].latch);
+                pages[id].version.fetch_add(1, std::memory_order_acquire);
+                memcpy(mem_node(id), node, sizeof(btree_node));
+                pages[id].version.fetch_add(1, std::memory_order_release);
+            }
+            delete node;
+            return;
+        }
         if (cache_type == 2)
         {
-            node_write_buffer2[id] = node;
+            auto &slot = node_write_buffer2[id];
+            if (slot != node)
+            {
+                delete slot;
+            }
+            slot = node;
             if (node_write_buffer2.size() == node_buffer_size)
             {
                 set_node_buffer();
@@ -200,66 +329,88 @@ private:
         }
         else if (cache_type == 1)
         {
-            node_write_buffer1.put(id, node);
-        }
-        size_t state;
-        {
-            std::unique_lock lock(*small_mutex[id]);
-            rewind(nodes[id]);
-            state = fwrite(node, sizeof(btree_node), 1, nodes[id]);
-        }
-        if (cache_type == 0)
-        {
+            auto f = pool->pin_exclusive(id, false);
+            memcpy(f->data, node, sizeof(btree_node));
+            pool->unpin_exclusive(f);
             delete node;
+            return;
         }
-
-        if (state != 1)
         {
-            fprintf(stderr, "btree: I/O error in set_node\n");
-            abort();
+            std::unique_lock lock(pages[id].latch);
+            pages[id].version.fetch_add(1, std::memory_order_acquire);
+            store.write(id, node, sizeof(btree_node));
+            pages[id].version.fetch_add(1, std::memory_order_release);
         }
+        delete node;
     }
 
-    void set_node_single(uint32_t id, btree_node *node)
+    // wait for the batch in flight and drop the pages it was writing
+    void finish_flushing()
     {
-        rewind(nodes[id]);
-        fwrite(node, sizeof(btree_node), 1, nodes[id]);
-        delete node;
+        writer->drain();
+        for (auto it : node_flushing)
+        {
+            delete it.second;
+        }
+        node_flushing.clear();
+        for (auto it : data_flushing)
+        {
+            delete it.second;
+        }
+        data_flushing.clear();
     }
 
-    void set_node_buffer()
+    // hand the write buffer(s) to the writer as one batch
+    void flush_write_buffer(bool nodes, bool datas)
     {
-        std::vector<std::thread *> threads(node_buffer_size);
-        int i = 0;
-        for (auto it : node_write_buffer2)
+        finish_flushing();
+        std::vector<async_writer::page> pages;
+        if (nodes)
         {
-            threads[i++] = new std::thread(&btree_wrapper::set_node_single, this, it.first, it.second);
+            node_flushing.swap(node_write_buffer2);
+            for (auto it : node_flushing)
+            {
+                pages.push_back({it.first, it.second, sizeof(btree_node)});
+            }
         }
-        // printf("%d %d\n", i, node_buffer_size);
-        // fflush(stdout);
-        for (i = 0; i < node_buffer_size; ++i)
+        if (datas)
         {
-            threads[i]->join();
-            delete threads[i];
+            data_flushing.swap(data_write_buffer2);
+            for (auto it : data_flushing)
+            {
+                pages.push_back({it.first, it.second, sizeof(btree_data)});
+            }
         }
-        node_write_buffer2.clear();
-        // printf("end set node buffer\n");
+        op_stats.add(tree_stats::PAGE_WRITES, pages.size());
+        op_stats.add(tree_stats::BYTES_WRITTEN, pages.size() * store.page_size());
+        writer->submit(pages);
+    }
+
+    void set_node_buffer()
+    {
+        flush_write_buffer(true, false);
+    }
+
+    // a fresh page id with its locks, nothing written to it yet
+    uint32_t new_page_id(bool leaf)
+    {
+        auto id = store.alloc_page();
+        // printf("adding new page %lld\n", id);
+        // a page freed by a merge keeps its descriptor, version included
+        pages.get(id).leaf.store(leaf, std::memory_order_release);
+        pages[id].tail_inserts = 0;
+        pages[id].ascending = 0;
+        return id;
     }
 
     uint32_t init_new_node(btree_node *node = nullptr)
     {
-        std::unique_lock lock(new_mutex);
-        auto id = nodes.size();
-        // printf("adding new node %lld\n", id);
-        std::string file_name = "./btree/btree_node_" + std::to_string(id);
-        nodes.push_back(fopen(file_name.c_str(), "w+b"));
-        is_leaf.push_back(false);
-        small_mutex.push_back(new std::shared_mutex);
-        large_mutex.push_back(new std::shared_mutex);
+        auto id = new_page_id(false);
         if (node == nullptr)
         {
             node = new btree_node;
             memset(node, 0, sizeof(btree_node));
+            node->right = INVALID_PAGE;
             set_node(id, node);
         }
         else
@@ -269,244 +420,653 @@ private:
         return id;
     }
 
+    // a copy of leaf id with its delta chain folded in
     btree_data *get_data(uint32_t id)
     {
-
         btree_data *data = new btree_data;
+        bool cached = false;
         if (cache_type == 2)
         {
-            if (data_write_buffer2.count(id))
+            auto it = data_write_buffer2.find(id);
+            if (it != data_write_buffer2.end() || (it = data_flushing.find(id)) != data_flushing.end())
             {
-                memcpy(data, data_write_buffer2[id], sizeof(btree_data));
-                return data;
+                op_stats.add(tree_stats::CACHE_HITS);
+                memcpy(data, it->second, sizeof(btree_data));
+                cached = true;
             }
-        }
-        else if (cache_type == 1)
-        {
-            if (data_write_buffer1.exist(id))
+            else
             {
-                memcpy(data, data_write_buffer1.get(id), sizeof(btree_data));
-                return data;
+                op_stats.add(tree_stats::CACHE_MISSES);
             }
         }
-        size_t state;
+        else if (cache_type == 1)
         {
-            std::unique_lock lock(*small_mutex[id]);
-            rewind(nodes[id]);
-            state = fread(data, sizeof(btree_data), 1, nodes[id]);
+            auto f = pool->pin_shared(id);
+            memcpy(data, f->data, sizeof(btree_data));
+            pool->unpin_shared(f);
+            cached = true;
         }
-        if (state != 1)
+        if (!cached)
         {
-            fprintf(stderr, "btree: I/O error in get_data\n");
-            abort();
+            store.read(id, data, sizeof(btree_data));
         }
+        fold_deltas(id, data);
         return data;
     }
 
+    // the image replaces the delta chain of the page too, so it must come
+    // from get_data under the page lock
     void set_data(uint32_t id, btree_data *data)
     {
+        delta *chain;
         if (cache_type == 2)
         {
-            data_write_buffer2[id] = data;
+            chain = pages[id].deltas.exchange(nullptr, std::memory_order_acq_rel);
+            auto &slot = data_write_buffer2[id];
+            if (slot != data)
+            {
+                delete slot;
+            }
+            slot = data;
             if (data_write_buffer2.size() == node_buffer_size)
             {
                 set_data_buffer();
             }
-            return;
         }
         else if (cache_type == 1)
         {
-            data_write_buffer1.put(id, data);
+            auto f = pool->pin_exclusive(id, false);
+            memcpy(f->data, data, sizeof(btree_data));
+            chain = pages[id].deltas.exchange(nullptr, std::memory_order_acq_rel);
+            pool->unpin_exclusive(f);
+            delete data;
         }
-        size_t state;
+        else
         {
-            std::unique_lock lock(*small_mutex[id]);
-            rewind(nodes[id]);
-            state = fwrite(data, sizeof(btree_data), 1, nodes[id]);
+            {
+                std::unique_lock lock(pages[id].latch);
+                pages[id].version.fetch_add(1, std::memory_order_acquire);
+                store.write(id, data, sizeof(btree_data));
+                chain = pages[id].deltas.exchange(nullptr, std::memory_order_acq_rel);
+                pages[id].version.fetch_add(1, std::memory_order_release);
+            }
+            delete data;
         }
-        if (cache_type == 0)
+        if (chain != nullptr)
         {
-            delete data;
+            retire_deltas(chain);
         }
+    }
 
-        if (state != 1)
+    // run fn on the deltas of leaf id, oldest first
+    template <typename F>
+    void for_deltas(uint32_t id, F &&fn)
+    {
+        delta *d = delta_updates ? pages[id].deltas.load(std::memory_order_acquire) : nullptr;
+        if (d == nullptr)
         {
-            fprintf(stderr, "btree: I/O error in set_data\n");
-            abort();
+            return;
+        }
+        std::vector<const delta *> chain;
+        for (; d != nullptr; d = d->next)
+        {
+            chain.push_back(d);
+        }
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it)
+        {
+            fn(**it);
         }
     }
 
-    void set_data_single(uint32_t id, btree_data *data)
+    // overwrite the values of the keys of data that have a delta on leaf id
+    void fold_deltas(uint32_t id, btree_data *data)
     {
-        rewind(nodes[id]);
-        fwrite(data, sizeof(btree_data), 1, nodes[id]);
-        delete data;
+        for_deltas(id, [&](const delta &d) {
+            size_t i = find_item(data, d.key);
+            if (i < data->num_item)
+            {
+                data->val[i] = d.val;
+            }
+        });
     }
 
-    void set_data_buffer()
+    // the newest value of key in the delta chain of leaf id, if it has one
+    bool delta_val(uint32_t id, Key key, T &val)
     {
-        std::vector<std::thread *> threads(node_buffer_size);
-        int i = 0;
-        for (auto it : data_write_buffer2)
-        {
-            threads[i++] = new std::thread(&btree_wrapper::set_data_single, this, it.first, it.second);
-        }
-        for (i = 0; i < node_buffer_size; ++i)
+        delta *d = delta_updates ? pages[id].deltas.load(std::memory_order_acquire) : nullptr;
+        for (; d != nullptr; d = d->next)
         {
-            threads[i]->join();
-            delete threads[i];
+            if (d->key == key)
+            {
+                val = d->val;
+                return true;
+            }
         }
-        data_write_buffer2.clear();
+        return false;
     }
 
-    uint32_t init_new_data(btree_data *data = nullptr)
+    // prepend key's new value to the chain of leaf id, whose lock is held
+    // shared at least; returns the length of the chain with it
+    uint32_t push_delta(uint32_t id, Key key, const T &val)
     {
-        std::unique_lock lock(new_mutex);
-        auto id = nodes.size();
-        // printf("adding new data %lld\n", id);
-        std::string file_name = "./btree/btree_data_" + std::to_string(id);
-        nodes.push_back(fopen(file_name.c_str(), "w+b"));
-        is_leaf.push_back(true);
-        small_mutex.push_back(new std::shared_mutex);
-        large_mutex.push_back(new std::shared_mutex);
-        if (data == nullptr)
-        {
-            data = new btree_data;
-            memset(data, 0, sizeof(btree_data));
-            set_data(id, data);
-        }
-        else
+        auto &head = pages[id].deltas;
+        delta *d = new delta{key, val, head.load(std::memory_order_acquire), 0};
+        do
         {
-            set_data(id, data);
-        }
-        return id;
+            d->depth = d->next == nullptr ? 1 : d->next->depth + 1;
+        } while (!head.compare_exchange_weak(d->next, d, std::memory_order_release, std::memory_order_acquire));
+        return d->depth;
     }
 
-    uint32_t get_nxt_id(btree_node *node, Key key)
+    // fold the chain of leaf id into the page
+    void consolidate(uint32_t id)
     {
-        auto loc = std::upper_bound(node->key, node->key + node->num_item - 1, key);
-        // printf("=%lld get %lld\n", key, loc - node->key);
-        return node->nxt[loc - node->key];
+        pages[id].lock.lock();
+        // a dead or reused page has no chain
+        if (pages[id].deltas.load(std::memory_order_acquire) != nullptr)
+        {
+            set_data(id, get_data(id));
+        }
+        pages[id].lock.unlock();
     }
 
-    bool get_nxt_val(btree_data *data, Key key, T &val)
+    // no update may run
+    void consolidate_all()
     {
-        auto loc = std::lower_bound(data->key, data->key + data->num_item, key);
-        if (loc == data->key + data->num_item || *loc != key)
+        for (uint32_t id = 0, n = store.num_pages(); id < n; ++id)
         {
-            return false;
+            if (pages[id].deltas.load(std::memory_order_acquire) != nullptr)
+            {
+                consolidate(id);
+            }
         }
-        val = data->val[loc - data->key];
-        return true;
     }
 
-    bool set_nxt_val(btree_data *data, Key key, T &val)
+    // chain of leaf id reached depth: hand it to the consolidator when it
+    // gets due, fold it here when the consolidator falls far behind
+    void consolidate_later(uint32_t id, uint32_t depth)
     {
-        auto loc = std::lower_bound(data->key, data->key + data->num_item, key);
-        if (loc == data->key + data->num_item || *loc != key)
+        if (!consolidator.joinable() || depth >= 4 * delta_chain)
         {
-            return false;
+            consolidate(id);
+            return;
+        }
+        if (depth == delta_chain)
+        {
+            {
+                std::unique_lock lock(consolidate_mutex);
+                consolidate_queue.push_back(id);
+            }
+            consolidate_cv.notify_one();
         }
-        data->val[loc - data->key] = val;
-        return true;
     }
 
-    bool del_nxt_val(btree_data *data, Key key)
+    void consolidate_loop()
     {
-        auto loc = std::lower_bound(data->key, data->key + data->num_item, key);
-        if (loc == data->key + data->num_item || *loc != key)
+        std::vector<uint32_t> ids;
+        std::unique_lock lock(consolidate_mutex);
+        while (true)
         {
-            return false;
+            consolidate_cv.wait(lock, [&] { return consolidate_stop || !consolidate_queue.empty(); });
+            if (consolidate_queue.empty())
+            {
+                return;
+            }
+            ids.swap(consolidate_queue);
+            lock.unlock();
+            for (auto id : ids)
+            {
+                consolidate(id);
+            }
+            ids.clear();
+            lock.lock();
         }
-        size_t diff = loc - data->key;
-        --data->num_item;
-        memmove(data->key + diff, data->key + diff + 1, (data->num_item - diff) * sizeof(Key));
-        memmove(data->val + diff, data->val + diff + 1, (data->num_item - diff) * sizeof(T));
-        return true;
     }
 
-    void print_data(btree_data *data, size_t num)
+    void set_data_buffer()
     {
-        std::unique_lock print_lock(print_small_mutex);
-        printf("key: ");
-        for (size_t i = 0; i < num; ++i)
+        flush_write_buffer(false, true);
+    }
+
+    uint32_t init_new_data(btree_data *data = nullptr)
+    {
+        auto id = new_page_id(true);
+        if (data == nullptr)
         {
-            printf("%12lld", data->key[i]);
+            data = new btree_data;
+            memset(data, 0, sizeof(btree_data));
+            data->right = INVALID_PAGE;
+            set_data(id, data);
         }
-        printf("\nval: ");
-        for (size_t i = 0; i < num; ++i)
+        else
         {
-            printf("%12lld", data->val[i]);
+            set_data(id, data);
         }
-        printf("\n");
+        return id;
     }
 
-    void print_node(btree_node *node, size_t num)
+    // a root over two empty leaves
+    void init_tree()
     {
-        std::unique_lock print_lock(print_small_mutex);
-        printf("key: ");
-        for (size_t i = 0; i < num - 1; ++i)
+        btree_node *node = new btree_node;
+        memset(node, 0, sizeof(btree_node));
+        node->nxt[0] = 1;
+        node->key[0] = 2e9;
+        node->nxt[1] = 2;
+        node->num_item = 2;
+        node->level = 1;
+        node->right = INVALID_PAGE;
+        init_new_node(node);
+        btree_data *data = new btree_data;
+        memset(data, 0, sizeof(btree_data));
+        data->right = 2;
+        data->high_key = 2e9;
+        init_new_data(data);
+        init_new_data();
+        root_id.store(0);
+    }
+
+    template <typename P>
+    P *get_page(uint32_t id)
+    {
+        if constexpr (std::is_same<P, btree_node>::value)
         {
-            printf("%12lld", node->key[i]);
+            return get_node(id);
         }
-        printf("\nnxt: ");
-        for (size_t i = 0; i < num; ++i)
+        else
         {
-            printf("%12lld", node->nxt[i]);
+            return get_data(id);
         }
-        printf("\n");
     }
 
-    void insert_data_item(btree_data *data, Key key, T &val)
+    template <typename P>
+    void set_page(uint32_t id, P *page)
     {
-        size_t i = std::upper_bound(data->key, data->key + data->num_item, key) - data->key;
-        /*for (i = 0; i < data->num_item; ++i)
+        if constexpr (std::is_same<P, btree_node>::value)
         {
-            if (key <= data->key[i])
-            {
-                break;
-            }
-        }*/
-        if (i < data->num_item)
+            set_node(id, page);
+        }
+        else
         {
-            memmove(data->key + i + 1, data->key + i, (data->num_item - i) * sizeof(Key));
-            memmove(data->val + i + 1, data->val + i, (data->num_item - i) * sizeof(T));
+            set_data(id, page);
         }
-        data->key[i] = key;
-        data->val[i] = val;
-        ++data->num_item;
-        // printf("==%lld %lld %lld\n", i, key, val);
-        // print_data(data);
     }
-    // old:  l   r
-    //       ld  rd
-    // new:  l   key r
-    // new:  ld  nxt  rd
-    void insert_node_item(btree_node *node, Key key, uint32_t nxt)
+
+    // read-only view of a page: the in-memory inner node or the pinned pool
+    // frame itself, or a private copy when there is no buffer pool
+    template <typename P>
+    class page_ref
     {
-        size_t i = std::upper_bound(node->key, node->key + node->num_item - 1, key) - node->key;
-        /*for (i = 0; i + 1 < node->num_item; ++i)
+    public:
+        page_ref(btree_wrapper *tree, uint32_t id) : pool(tree->pool.get())
         {
-            if (key <= node->key[i])
+            if (P *p = tree->template resident<P>(id))
             {
-                break;
+                latch = &tree->pages[id].latch;
+                latch->lock_shared();
+                page = p;
             }
-        }*/
-        if (i < node->num_item)
+            else if (pool != nullptr)
+            {
+                f = pool->pin_shared(id);
+                page = reinterpret_cast<const P *>(f->data);
+            }
+            else
+            {
+                page = tree->template get_page<P>(id);
+            }
+        }
+        ~page_ref()
         {
-            memmove(node->key + i + 1, node->key + i, (node->num_item - 1 - i) * sizeof(Key));
-            memmove(node->nxt + i + 1, node->nxt + i, (node->num_item - i) * sizeof(uint32_t));
+            if (latch != nullptr)
+            {
+                latch->unlock_shared();
+            }
+            else if (f != nullptr)
+            {
+                pool->unpin_shared(f);
+            }
+            else
+            {
+                delete page;
+            }
         }
-        node->key[i] = key;
-        node->nxt[i] = nxt;
-        ++node->num_item;
-        // printf("==%lld %lld %lld\n", i, key, nxt);
-        // print_node(node);
-    }
+        page_ref(const page_ref &) = delete;
+        page_ref &operator=(const page_ref &) = delete;
 
-    void print_state(size_t id, bool iterative = false)
-    {
-        if (!is_leaf[id])
+        const P *get() const
+        {
+            return page;
+        }
+        const P *operator->() const
+        {
+            return page;
+        }
+
+    private:
+        buffer_pool *pool;
+        buffer_pool::frame *f = nullptr;
+        page_latch *latch = nullptr;
+        const P *page;
+    };
+
+    // writable page, modified in place in the in-memory inner node or the pool
+    // frame; without a pool it is a private copy that is written back on
+    // release if marked dirty
+    template <typename P>
+    class page_mut
+    {
+    public:
+        page_mut(btree_wrapper *tree, uint32_t id) : tree(tree), id(id), pool(tree->pool.get())
+        {
+            if (P *p = tree->template resident<P>(id))
+            {
+                // odd version until release, like a latched pool frame
+                latch = &tree->pages[id].latch;
+                latch->lock();
+                tree->pages[id].version.fetch_add(1, std::memory_order_acquire);
+                page = p;
+            }
+            else if (pool != nullptr)
+            {
+                f = pool->pin_exclusive(id);
+                page = reinterpret_cast<P *>(f->data);
+            }
+            else
+            {
+                page = tree->template get_page<P>(id);
+            }
+        }
+        ~page_mut()
+        {
+            if (latch != nullptr)
+            {
+                tree->pages[id].version.fetch_add(1, std::memory_order_release);
+                latch->unlock();
+            }
+            else if (f != nullptr)
+            {
+                pool->unpin_exclusive(f, dirty);
+            }
+            else if (dirty)
+            {
+                tree->set_page(id, page);
+            }
+            else
+            {
+                delete page;
+            }
+        }
+        page_mut(const page_mut &) = delete;
+        page_mut &operator=(const page_mut &) = delete;
+
+        P *get() const
+        {
+            return page;
+        }
+        P *operator->() const
+        {
+            return page;
+        }
+        void mark_dirty()
+        {
+            dirty = true;
+        }
+
+    private:
+        btree_wrapper *tree;
+        uint32_t id;
+        buffer_pool *pool;
+        buffer_pool::frame *f = nullptr;
+        page_latch *latch = nullptr;
+        P *page;
+        bool dirty = false;
+    };
+
+    // run fn on an image of page id without taking any lock, again and again
+    // until fn accepts the image and no writer touched the page meanwhile;
+    // fn may see a torn page and must reject what it cannot index safely
+    template <typename P, typename F>
+    void read_optimistic(uint32_t id, F &&fn)
+    {
+        P *mem = resident<P>(id);
+        if (pool != nullptr && mem == nullptr)
+        {
+            while (true)
+            {
+                uint64_t version;
+                const char *data = pool->peek(id, version);
+                if (data == nullptr)
+                {
+                    // not resident or being written, take the pinned path
+                    page_ref<P> page(this, id);
+                    if (fn(page.get()))
+                    {
+                        return;
+                    }
+                    continue;
+                }
+                if (fn(reinterpret_cast<const P *>(data)) && pool->validate(data, version))
+                {
+                    return;
+                }
+            }
+        }
+        while (true)
+        {
+            uint64_t version = pages[id].version.load(std::memory_order_acquire);
+            if (version & 1)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            P *page = mem != nullptr ? mem : get_page<P>(id);
+            bool ok = fn(page);
+            if (page != mem)
+            {
+                delete page;
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (ok && pages[id].version.load(std::memory_order_relaxed) == version)
+            {
+                return;
+            }
+        }
+    }
+
+    // the counts of a page read optimistically may change under the reader,
+    // so they are read once, with a load the compiler may not repeat, and
+    // kept within the page
+    static uint32_t read_once(const uint32_t &count)
+    {
+        return __atomic_load_n(&count, __ATOMIC_RELAXED);
+    }
+
+    uint32_t get_nxt_id(const btree_node *node, Key key)
+    {
+        size_t n = std::clamp<uint32_t>(read_once(node->num_item), 1, node_cap);
+        auto loc = node->key + node_search::upper_index(node->key, n - 1, key);
+        // printf("=%lld get %lld\n", key, loc - node->key);
+        return node->nxt[loc - node->key];
+    }
+
+    // position of the first item with key, num_item if there is none; the
+    // sorted items come before the appended ones, so older duplicates win
+    size_t find_item(const btree_data *data, Key key)
+    {
+        size_t n = std::min<size_t>(read_once(data->num_item), data_cap);
+        size_t sorted = n - std::min<size_t>(read_once(data->num_appended), n);
+        size_t i = node_search::lower_index(data->key, sorted, key);
+        if (i < sorted && data->key[i] == key)
+        {
+            return i;
+        }
+        for (i = sorted; i < n && data->key[i] != key; ++i)
+        {
+        }
+        return i;
+    }
+
+    bool get_nxt_val(const btree_data *data, Key key, T &val)
+    {
+        size_t i = find_item(data, key);
+        if (i >= std::min<size_t>(read_once(data->num_item), data_cap))
+        {
+            return false;
+        }
+        val = data->val[i];
+        return true;
+    }
+
+    bool set_nxt_val(btree_data *data, Key key, T &val)
+    {
+        size_t i = find_item(data, key);
+        if (i == data->num_item)
+        {
+            return false;
+        }
+        data->val[i] = val;
+        return true;
+    }
+
+    bool del_nxt_val(btree_data *data, Key key)
+    {
+        size_t diff = find_item(data, key);
+        if (diff == data->num_item)
+        {
+            return false;
+        }
+        if (diff >= data->num_item - data->num_appended)
+        {
+            --data->num_appended;
+        }
+        --data->num_item;
+        memmove(data->key + diff, data->key + diff + 1, (data->num_item - diff) * sizeof(Key));
+        memmove(data->val + diff, data->val + diff + 1, (data->num_item - diff) * sizeof(T));
+        return true;
+    }
+
+    void print_data(btree_data *data, size_t num)
+    {
+        std::unique_lock print_lock(print_small_mutex);
+        printf("key: ");
+        for (size_t i = 0; i < num; ++i)
+        {
+            printf("%12lld", data->key[i]);
+        }
+        printf("\nval: ");
+        for (size_t i = 0; i < num; ++i)
+        {
+            printf("%12lld", data->val[i]);
+        }
+        printf("\n");
+    }
+
+    void print_node(btree_node *node, size_t num)
+    {
+        std::unique_lock print_lock(print_small_mutex);
+        printf("key: ");
+        for (size_t i = 0; i < num - 1; ++i)
+        {
+            printf("%12lld", node->key[i]);
+        }
+        printf("\nnxt: ");
+        for (size_t i = 0; i < num; ++i)
+        {
+            printf("%12lld", node->nxt[i]);
+        }
+        printf("\n");
+    }
+
+    void insert_data_item(btree_data *data, Key key, T &val)
+    {
+        size_t i = node_search::upper_index(data->key, data->num_item, key);
+        /*for (i = 0; i < data->num_item; ++i)
+        {
+            if (key <= data->key[i])
+            {
+                break;
+            }
+        }*/
+        if (i < data->num_item)
+        {
+            memmove(data->key + i + 1, data->key + i, (data->num_item - i) * sizeof(Key));
+            memmove(data->val + i + 1, data->val + i, (data->num_item - i) * sizeof(T));
+        }
+        data->key[i] = key;
+        data->val[i] = val;
+        ++data->num_item;
+        // printf("==%lld %lld %lld\n", i, key, val);
+        // print_data(data);
+    }
+    // add the item at the end, merging the appended items in once there are
+    // leaf_append of them
+    void append_data_item(btree_data *data, Key key, T &val)
+    {
+        data->key[data->num_item] = key;
+        data->val[data->num_item] = val;
+        ++data->num_item;
+        if (++data->num_appended == leaf_append)
+        {
+            sort_appended(data);
+        }
+    }
+
+    // merge the appended items into the sorted ones, behind equal keys
+    void sort_appended(btree_data *data)
+    {
+        uint32_t m = data->num_appended, i = data->num_item - m, w = data->num_item;
+        if (m == 0)
+        {
+            return;
+        }
+        std::vector<std::pair<Key, T>> tail(m);
+        for (uint32_t j = 0; j < m; ++j)
+        {
+            tail[j] = {data->key[i + j], data->val[i + j]};
+        }
+        std::stable_sort(tail.begin(), tail.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+        while (m > 0)
+        {
+            --w;
+            if (i > 0 && data->key[i - 1] > tail[m - 1].first)
+            {
+                --i;
+                data->key[w] = data->key[i];
+                data->val[w] = data->val[i];
+            }
+            else
+            {
+                --m;
+                data->key[w] = tail[m].first;
+                data->val[w] = tail[m].second;
+            }
+        }
+        data->num_appended = 0;
+    }
+
+    // old:  l   r
+    //       ld  rd
+    // new:  l   key r
+    // new:  ld  ld  nxt  rd
+    void insert_node_item(btree_node *node, Key key, uint32_t nxt)
+    {
+        size_t i = node_search::upper_index(node->key, node->num_item - 1, key);
+        if (i + 1 < node->num_item)
+        {
+            memmove(node->key + i + 1, node->key + i, (node->num_item - 1 - i) * sizeof(Key));
+            memmove(node->nxt + i + 2, node->nxt + i + 1, (node->num_item - 1 - i) * sizeof(uint32_t));
+        }
+        node->key[i] = key;
+        node->nxt[i + 1] = nxt;
+        ++node->num_item;
+        // printf("==%lld %lld %lld\n", i, key, nxt);
+        // print_node(node);
+    }
+
+    void print_state(size_t id, bool iterative = false)
+    {
+        if (!is_leaf(id))
         {
             btree_node *node = get_node(id);
             {
@@ -553,507 +1113,1343 @@ private:
         }
     }
 
+    // largest key of a leaf, which need not be the last with appended items
+    Key last_key(const btree_data *data)
+    {
+        uint32_t sorted = data->num_item - data->num_appended;
+        Key last = data->key[sorted > 0 ? sorted - 1 : 0];
+        for (uint32_t i = sorted; i < data->num_item; ++i)
+        {
+            last = std::max(last, data->key[i]);
+        }
+        return last;
+    }
+
+    // count an insert into the locked page id by where it went among its n
+    // keys, the last of them last; one that did not go near the end halves
+    // the count, so stray keys only slow it down
+    void note_insert(uint32_t id, const Key *key, uint32_t n, uint32_t cap, Key k, bool past_last)
+    {
+        auto &desc = pages[id];
+        uint32_t slack = cap / 10;
+        if (n <= slack || k > key[n - 1 - slack])
+        {
+            desc.tail_inserts = std::min<uint32_t>(desc.tail_inserts + 1, UINT16_MAX);
+        }
+        else
+        {
+            desc.tail_inserts /= 2;
+        }
+        desc.ascending = past_last ? std::min<uint32_t>(desc.ascending + 1, UINT16_MAX) : 0;
+    }
+
+    // items the left page keeps when the locked page id splits with cap
+    // items, leaving at least min_right to the right: the middle, unless
+    // inserts kept going to the end, then 90%, and all but the newest items
+    // when they only came in ascending lately
+    uint32_t split_point(uint32_t id, uint32_t cap, uint32_t min_right)
+    {
+        uint32_t at = cap / 2;
+        if (adaptive_split && pages[id].ascending >= SEQ_SPLIT)
+        {
+            at = cap - min_right;
+        }
+        else if (adaptive_split && pages[id].tail_inserts >= SEQ_SPLIT)
+        {
+            at = cap - cap / 10;
+        }
+        return std::max(std::min(at, cap - min_right), cap / 2);
+    }
+
+    // the right page of a split goes on growing at its end, if anything does
+    void split_hints(uint32_t id, uint32_t nxt)
+    {
+        pages[nxt].tail_inserts = pages[id].tail_inserts;
+        pages[nxt].ascending = pages[id].ascending;
+        pages[id].tail_inserts = 0;
+        pages[id].ascending = 0;
+    }
+
     // must add lock before call
-    void split_data(btree_data *data_r, btree_node *node_fa)
+    // the items from the split point on move to a new right sibling, returns
+    // its id and separator
+    uint32_t split_data(uint32_t id, btree_data *data_l, Key &sep)
     {
-        btree_data *data_l = new btree_data;
-        memcpy(data_l->key, data_r->key, data_cap / 2 * sizeof(Key));
-        memcpy(data_l->val, data_r->val, data_cap / 2 * sizeof(T));
-        data_l->num_item = data_cap / 2;
-        uint32_t nxt = init_new_data(data_l);
-        uint32_t k = data_r->key[data_cap / 2];
-        memmove(data_r->key, data_r->key + data_cap / 2, (data_cap - data_cap / 2) * sizeof(Key));
-        memmove(data_r->val, data_r->val + data_cap / 2, (data_cap - data_cap / 2) * sizeof(T));
-        data_r->num_item = data_cap - data_cap / 2;
-        insert_node_item(node_fa, k, nxt);
+        op_stats.add(tree_stats::SPLITS);
+        sort_appended(data_l);
+        btree_data *data_r = new btree_data;
+        memset(data_r, 0, sizeof(btree_data));
+        uint32_t half = split_point(id, data_cap, 1);
+        memcpy(data_r->key, data_l->key + half, (data_cap - half) * sizeof(Key));
+        memcpy(data_r->val, data_l->val + half, (data_cap - half) * sizeof(T));
+        data_r->num_item = data_cap - half;
+        data_r->num_appended = 0;
+        data_r->right = data_l->right;
+        data_r->high_key = data_l->high_key;
+        sep = data_r->key[0];
+        uint32_t nxt = init_new_data(data_r);
+        data_l->num_item = half;
+        data_l->right = nxt;
+        data_l->high_key = sep;
+        split_hints(id, nxt);
+        return nxt;
     }
 
     // must add lock before call
-    void split_node(btree_node *node_r, btree_node *node_fa)
+    uint32_t split_node(uint32_t id, btree_node *node_l, Key &sep)
     {
-        btree_node *node_l = new btree_node;
-        memcpy(node_l->key, node_r->key, (node_cap / 2 - 1) * sizeof(Key));
-        memcpy(node_l->nxt, node_r->nxt, node_cap / 2 * sizeof(uint32_t));
-        node_l->num_item = node_cap / 2;
-        uint32_t nxt = init_new_node(node_l);
-        uint32_t k = node_r->key[node_cap / 2 - 1];
-        memmove(node_r->key, node_r->key + node_cap / 2, (node_cap - node_cap / 2 - 1) * sizeof(Key));
-        memmove(node_r->nxt, node_r->nxt + node_cap / 2, (node_cap - node_cap / 2) * sizeof(uint32_t));
-        node_r->num_item = node_cap - node_cap / 2;
-        insert_node_item(node_fa, k, nxt);
+        op_stats.add(tree_stats::SPLITS);
+        btree_node *node_r = new btree_node;
+        memset(node_r, 0, sizeof(btree_node));
+        uint32_t half = split_point(id, node_cap, 2);
+        sep = node_l->key[half - 1];
+        memcpy(node_r->key, node_l->key + half, (node_cap - half - 1) * sizeof(Key));
+        memcpy(node_r->nxt, node_l->nxt + half, (node_cap - half) * sizeof(uint32_t));
+        node_r->num_item = node_cap - half;
+        node_r->level = node_l->level;
+        node_r->right = node_l->right;
+        node_r->high_key = node_l->high_key;
+        uint32_t nxt = init_new_node(node_r);
+        node_l->num_item = half;
+        node_l->right = nxt;
+        node_l->high_key = sep;
+        split_hints(id, nxt);
+        return nxt;
     }
 
-    void down_insert_lock(std::vector<uint32_t> &x_locked, std::vector<uint32_t> &s_locked, uint32_t lock_mode, uint32_t cur_id, uint32_t pre_id = -1)
+    // children of the level 1 node fa_id from the one covering key onwards
+    // (all of them when from_start), appended to leaves; returns the right
+    // sibling of the node they were taken from
+    uint32_t collect_leaves(uint32_t fa_id, Key key, bool from_start, std::vector<uint32_t> &leaves)
     {
-        if (pre_id == -1)
-        { // the first down lock
-            if (lock_mode == 0)
+        while (true)
+        {
+            uint32_t right = INVALID_PAGE;
+            size_t n = leaves.size();
+            bool dead = false;
+            read_optimistic<btree_node>(fa_id, [&](const btree_node *node) {
+                // the page may change under us, num_item is read once
+                uint32_t num_item = read_once(node->num_item);
+                if ((dead = num_item == DEAD_PAGE))
+                {
+                    return true;
+                }
+                if (num_item < 1 || num_item > node_cap)
+                {
+                    return false;
+                }
+                leaves.resize(n);
+                right = node->right;
+                if (!from_start && right != INVALID_PAGE && key >= node->high_key)
+                {
+                    return true;
+                }
+                size_t i = 0;
+                if (!from_start)
+                {
+                    i = node_search::upper_index(node->key, num_item - 1, key);
+                }
+                leaves.insert(leaves.end(), node->nxt + i, node->nxt + num_item);
+                return true;
+            });
+            if (dead)
+            { // only read-ahead hints are lost
+                return INVALID_PAGE;
+            }
+            if (leaves.size() > n || right == INVALID_PAGE)
             {
-                // printf("00before slock %lld\n", cur_id);
-                large_mutex[cur_id]->lock_shared();
-                s_locked.push_back(cur_id);
-                // printf("01slock %lld\n", cur_id);
+                return right;
+            }
+            fa_id = right;
+        }
+    }
+
+    void prefetch_page(uint32_t id)
+    {
+        if (pool != nullptr)
+        {
+            pool->prefetch(id);
+        }
+        else if (cache_type != 2 || !data_write_buffer2.count(id))
+        {
+            store.prefetch(id);
+        }
+    }
+
+    std::shared_lock<std::shared_mutex> begin_op()
+    {
+        if (log || shadow_paging)
+        {
+            // the mutex prefers readers, let a due checkpoint in first
+            while (checkpointing.load(std::memory_order_acquire))
+            {
+                std::this_thread::yield();
+            }
+            return std::shared_lock<std::shared_mutex>(checkpoint_mutex);
+        }
+        return std::shared_lock<std::shared_mutex>();
+    }
+
+    // must be called with the page holding key still locked, so records of
+    // the same key are logged in the order they were applied
+    uint64_t log_op(wal::op_type type, const char *key, size_t key_sz, const char *val = nullptr, size_t val_sz = 0)
+    {
+        return log ? log->append(type, key, key_sz, val, val_sz) : 0;
+    }
+
+    // wait for the record to be durable, the group commit lets concurrent
+    // writers share one sync
+    void end_op(std::shared_lock<std::shared_mutex> &op, uint64_t lsn)
+    {
+        if (!log && !shadow_paging)
+        {
+            return;
+        }
+        op.unlock();
+        if (lsn > 0)
+        {
+            log->commit(lsn);
+        }
+        bool due = (log && log->size() >= checkpoint_bytes) ||
+                   (shadow_paging && store.superseded_pages() * PageBytes >= checkpoint_bytes);
+        if (due && !checkpointing.exchange(true))
+        {
+            checkpoint();
+            checkpointing.store(false);
+        }
+    }
+
+    // make every page durable so the log can start over; with shadow paging
+    // the pages also become the image reopening starts from, without it
+    // only the final checkpoint leaves one
+    void checkpoint(bool final = false)
+    {
+        std::unique_lock lock(checkpoint_mutex);
+        consolidate_all();
+        if (inner_in_memory)
+        {
+            persist_inner_nodes();
+        }
+        if (pool)
+        {
+            pool->flush_all();
+        }
+        else if (writer)
+        {
+            flush_write_buffer(true, true);
+            finish_flushing();
+        }
+        store.commit(root_id.load(std::memory_order_acquire), [&](uint32_t id) { return is_leaf(id); }, final);
+        if (log)
+        {
+            log->reset();
+        }
+    }
+
+    uint32_t get_root()
+    {
+        return root_id.load(std::memory_order_acquire);
+    }
+
+    // descend optimistically to the page at level that may hold key,
+    // path gets the inner nodes passed on the way, root first
+    uint32_t find_level(Key key, uint32_t level, std::vector<uint32_t> *path = nullptr)
+    {
+        uint32_t cur_id = get_root();
+        while (!is_leaf(cur_id))
+        {
+            uint32_t nxt_id = INVALID_PAGE;
+            bool down = false, dead = false;
+            read_optimistic<btree_node>(cur_id, [&](const btree_node *node) {
+                if ((dead = node->num_item == DEAD_PAGE))
+                {
+                    return true;
+                }
+                if (node->num_item < 1 || node->num_item > node_cap)
+                {
+                    return false;
+                }
+                down = false;
+                if (node->level == level)
+                {
+                    nxt_id = INVALID_PAGE;
+                }
+                else if (node->right != INVALID_PAGE && key >= node->high_key)
+                {
+                    nxt_id = node->right;
+                }
+                else
+                {
+                    nxt_id = get_nxt_id(node, key);
+                    down = true;
+                }
+                return true;
+            });
+            if (dead)
+            {
+                cur_id = get_root();
+                if (path != nullptr)
+                {
+                    path->clear();
+                }
+                continue;
+            }
+            if (nxt_id == INVALID_PAGE)
+            {
+                break;
+            }
+            if (down && path != nullptr)
+            {
+                path->push_back(cur_id);
+            }
+            cur_id = nxt_id;
+        }
+        return cur_id;
+    }
+
+    void lock_page(uint32_t id, bool shared)
+    {
+        shared ? pages[id].lock.lock_shared() : pages[id].lock.lock();
+    }
+
+    void unlock_page(uint32_t id, bool shared)
+    {
+        shared ? pages[id].lock.unlock_shared() : pages[id].lock.unlock();
+    }
+
+    // lock the page covering key, starting at cur_id and moving right on its
+    // level; INVALID_PAGE when cur_id turns out to be dead
+    uint32_t lock_covering(uint32_t cur_id, Key key, bool shared = false)
+    {
+        lock_page(cur_id, shared);
+        while (true)
+        {
+            uint32_t right, num_item;
+            Key high_key;
+            if (is_leaf(cur_id))
+            {
+                page_ref<btree_data> data(this, cur_id);
+                num_item = data->num_item;
+                right = data->right;
+                high_key = data->high_key;
             }
             else
             {
-                // printf("%lld prelock %lld\n", k_b, cur_id);
-                large_mutex[cur_id]->lock();
-                x_locked.push_back(cur_id);
-                // printf("%lld lock %lld\n", k_b, cur_id);
+                page_ref<btree_node> node(this, cur_id);
+                num_item = node->num_item;
+                right = node->right;
+                high_key = node->high_key;
+            }
+            if (num_item == DEAD_PAGE)
+            { // a live page never links to a dead one, so only the first can be
+                unlock_page(cur_id, shared);
+                return INVALID_PAGE;
+            }
+            if (right == INVALID_PAGE || key < high_key)
+            {
+                return cur_id;
             }
+            lock_page(right, shared);
+            unlock_page(cur_id, shared);
+            cur_id = right;
         }
-        else
+    }
+
+    // lock append_leaf if key goes past its last key and is still covered by
+    // it, so an insert of it needs no descent; INVALID_PAGE otherwise
+    uint32_t lock_append_leaf(Key key)
+    {
+        uint32_t id = append_leaf.load(std::memory_order_acquire);
+        if (id == INVALID_PAGE)
         {
-            if (lock_mode == 0)
+            return INVALID_PAGE;
+        }
+        pages[id].lock.lock();
+        if (is_leaf(id))
+        {
+            page_ref<btree_data> data(this, id);
+            if (data->num_item != DEAD_PAGE && data->num_item > 0 && key > last_key(data.get()) &&
+                (data->right == INVALID_PAGE || key < data->high_key))
+            {
+                return id;
+            }
+        }
+        pages[id].lock.unlock();
+        return INVALID_PAGE;
+    }
+
+    // cur_id (at level) is locked and was split into cur_id and nxt at sep;
+    // post the separator to the parents, releasing every lock taken
+    void insert_parent(std::vector<uint32_t> &path, uint32_t cur_id, uint32_t level, Key sep, uint32_t nxt)
+    {
+        while (true)
+        {
+            uint32_t fa_id;
+            if (!path.empty())
+            {
+                fa_id = lock_covering(path.back(), sep);
+                path.pop_back();
+                if (fa_id == INVALID_PAGE)
+                { // merged away, the tree may even have shrunk to cur_id
+                    path.clear();
+                    continue;
+                }
+            }
+            else
             {
-                if (!is_leaf[cur_id])
+                std::unique_lock lock(root_mutex);
+                if (root_id.load(std::memory_order_relaxed) == cur_id)
+                { // root is split
+                    btree_node *root = new btree_node;
+                    memset(root, 0, sizeof(btree_node));
+                    root->nxt[0] = cur_id;
+                    root->key[0] = sep;
+                    root->nxt[1] = nxt;
+                    root->num_item = 2;
+                    root->level = level + 1;
+                    root->right = INVALID_PAGE;
+                    root_id.store(init_new_node(root), std::memory_order_release);
+                    pages[cur_id].lock.unlock();
+                    return;
+                }
+                lock.unlock();
+                // the tree grew above the level we started from
+                fa_id = lock_covering(find_level(sep, level + 1), sep);
+                if (fa_id == INVALID_PAGE)
                 {
-                    // printf("11before slock %lld\n", cur_id);
-                    large_mutex[cur_id]->lock_shared();
-                    s_locked.push_back(cur_id);
-                    // printf("12slock %lld\n", cur_id);
+                    continue;
                 }
-                else
+            }
+            pages[cur_id].lock.unlock();
+            btree_node *node = get_node(fa_id);
+            if (adaptive_split)
+            {
+                // a root about to hand over to its only child has no key
+                uint32_t n = node->num_item - 1;
+                note_insert(fa_id, node->key, n, node_cap, sep, n == 0 || sep > node->key[n - 1]);
+            }
+            insert_node_item(node, sep, nxt);
+            if (node->num_item < node_cap)
+            {
+                set_node(fa_id, node);
+                pages[fa_id].lock.unlock();
+                return;
+            }
+            nxt = split_node(fa_id, node, sep);
+            set_node(fa_id, node);
+            cur_id = fa_id;
+            ++level;
+        }
+    }
+    // held by every operation while it may reach pages through the tree;
+    // only needed once something can be retired
+    class op_guard
+    {
+    public:
+        op_guard(btree_wrapper *tree)
+            : guard(tree->data_low > 0 || tree->delta_updates ? &tree->reclaimer : nullptr)
+        {
+        }
+
+    private:
+        typename epoch_reclaimer<garbage>::guard guard;
+    };
+
+    // page id was unlinked by a merge; it goes back to the page store once
+    // the operations that may still reach it are over
+    void retire_page(uint32_t id)
+    {
+        reclaimer.retire({id, nullptr});
+        // an insert holding the guard may still try it, and finds it dead
+        uint32_t last = id;
+        append_leaf.compare_exchange_strong(last, INVALID_PAGE);
+    }
+
+    // a delta chain was folded into its page; it is freed like a retired page
+    void retire_deltas(delta *chain)
+    {
+        reclaimer.retire({INVALID_PAGE, chain});
+    }
+
+    void reclaim(garbage &g)
+    {
+        if (g.chain == nullptr)
+        {
+            store.free_page(g.page);
+        }
+        for (delta *d = g.chain; d != nullptr;)
+        {
+            delta *next = d->next;
+            delete d;
+            d = next;
+        }
+    }
+
+    // leaves carry no separator; the parameter keeps one signature for
+    // rebalance() over both page types
+    void merge_pages(btree_data *data_l, btree_data *data_r, Key /*sep*/)
+    {
+        sort_appended(data_l);
+        sort_appended(data_r);
+        memcpy(data_l->key + data_l->num_item, data_r->key, data_r->num_item * sizeof(Key));
+        memcpy(data_l->val + data_l->num_item, data_r->val, data_r->num_item * sizeof(T));
+        data_l->num_item += data_r->num_item;
+    }
+
+    void merge_pages(btree_node *node_l, btree_node *node_r, Key sep)
+    {
+        node_l->key[node_l->num_item - 1] = sep;
+        memcpy(node_l->key + node_l->num_item, node_r->key, (node_r->num_item - 1) * sizeof(Key));
+        memcpy(node_l->nxt + node_l->num_item, node_r->nxt, node_r->num_item * sizeof(uint32_t));
+        node_l->num_item += node_r->num_item;
+    }
+
+    // share the items of data_l and data_r between data_l and the empty
+    // data_n, returns the separator between them; sep as for merge_pages
+    Key even_out(btree_data *data_l, btree_data *data_r, Key /*sep*/, btree_data *data_n)
+    {
+        sort_appended(data_l);
+        sort_appended(data_r);
+        uint32_t total = data_l->num_item + data_r->num_item, half = total / 2;
+        std::vector<Key> keys(data_l->key, data_l->key + data_l->num_item);
+        std::vector<T> vals(data_l->val, data_l->val + data_l->num_item);
+        keys.insert(keys.end(), data_r->key, data_r->key + data_r->num_item);
+        vals.insert(vals.end(), data_r->val, data_r->val + data_r->num_item);
+        std::copy(keys.begin(), keys.begin() + half, data_l->key);
+        std::copy(vals.begin(), vals.begin() + half, data_l->val);
+        std::copy(keys.begin() + half, keys.end(), data_n->key);
+        std::copy(vals.begin() + half, vals.end(), data_n->val);
+        data_l->num_item = half;
+        data_n->num_item = total - half;
+        return keys[half];
+    }
+
+    Key even_out(btree_node *node_l, btree_node *node_r, Key sep, btree_node *node_n)
+    {
+        uint32_t total = node_l->num_item + node_r->num_item, half = total / 2;
+        std::vector<Key> keys(node_l->key, node_l->key + node_l->num_item - 1);
+        std::vector<uint32_t> nxts(node_l->nxt, node_l->nxt + node_l->num_item);
+        keys.push_back(sep);
+        keys.insert(keys.end(), node_r->key, node_r->key + node_r->num_item - 1);
+        nxts.insert(nxts.end(), node_r->nxt, node_r->nxt + node_r->num_item);
+        std::copy(keys.begin(), keys.begin() + half - 1, node_l->key);
+        std::copy(nxts.begin(), nxts.begin() + half, node_l->nxt);
+        std::copy(keys.begin() + half, keys.end(), node_n->key);
+        std::copy(nxts.begin() + half, nxts.end(), node_n->nxt);
+        node_l->num_item = half;
+        node_n->num_item = total - half;
+        node_n->level = node_l->level;
+        return keys[half - 1];
+    }
+
+    // cur_id is locked and may have underflowed: merge its right sibling into
+    // it when both hang off the same parent, or even the pair out through a
+    // fresh right page when they do not fit into one; goes on with the parent
+    // and releases every lock taken
+    template <typename P>
+    void rebalance(std::vector<uint32_t> &path, uint32_t cur_id)
+    {
+        constexpr bool leaf = std::is_same<P, btree_data>::value;
+        P *page_l = get_page<P>(cur_id);
+        if constexpr (!leaf)
+        {
+            if (path.empty())
+            {
+                // a root left with one child hands over to it
+                std::unique_lock lock(root_mutex);
+                if (root_id.load(std::memory_order_relaxed) == cur_id && page_l->num_item == 1 && page_l->level > 1)
                 {
-                    // printf("21before xlock %lld\n", cur_id);
-                    large_mutex[cur_id]->lock();
-                    // printf("22xlock %lld\n", cur_id);
-                    x_locked.push_back(cur_id);
+                    root_id.store(page_l->nxt[0], std::memory_order_release);
+                    page_l->num_item = DEAD_PAGE;
+                    set_node(cur_id, page_l);
+                    pages[cur_id].lock.unlock();
+                    retire_page(cur_id);
+                    return;
                 }
             }
-            else
+        }
+        if (page_l->num_item >= (leaf ? data_low : node_low) || page_l->right == INVALID_PAGE || path.empty())
+        {
+            delete page_l;
+            pages[cur_id].lock.unlock();
+            return;
+        }
+        uint32_t right_id = page_l->right;
+        Key sep = page_l->high_key;
+        pages[right_id].lock.lock();
+        uint32_t fa_id = lock_covering(path.back(), sep);
+        path.pop_back();
+        btree_node *fa = fa_id == INVALID_PAGE ? nullptr : get_node(fa_id);
+        size_t i = 0;
+        if (fa != nullptr)
+        {
+            i = node_search::upper_index(fa->key, fa->num_item - 1, sep);
+        }
+        if (fa == nullptr || i == 0 || fa->nxt[i] != right_id || fa->nxt[i - 1] != cur_id)
+        {
+            // the right sibling has another parent or is not posted yet
+            if (fa != nullptr)
             {
-                // printf("%lld prelock %lld\n", k_b, cur_id);
-                large_mutex[cur_id]->lock();
-                // printf("%lld lock %lld\n", k_b, cur_id);
-                x_locked.push_back(cur_id);
+                delete fa;
+                pages[fa_id].lock.unlock();
             }
+            delete page_l;
+            pages[right_id].lock.unlock();
+            pages[cur_id].lock.unlock();
+            return;
+        }
+        P *page_r = get_page<P>(right_id);
+        if (page_l->num_item + page_r->num_item <= (leaf ? data_merge : node_merge))
+        {
+            merge_pages(page_l, page_r, sep);
+            op_stats.add(tree_stats::MERGES);
+            page_l->right = page_r->right;
+            page_l->high_key = page_r->high_key;
+            memmove(fa->key + i - 1, fa->key + i, (fa->num_item - 1 - i) * sizeof(Key));
+            memmove(fa->nxt + i, fa->nxt + i + 1, (fa->num_item - 1 - i) * sizeof(uint32_t));
+            --fa->num_item;
+            page_r->num_item = DEAD_PAGE;
+            set_page(cur_id, page_l);
+            set_page(right_id, page_r);
+            set_node(fa_id, fa);
+            pages[right_id].lock.unlock();
+            pages[cur_id].lock.unlock();
+            retire_page(right_id);
+            rebalance<btree_node>(path, fa_id);
+            return;
         }
+        // keys only ever move right under readers, so the right page is
+        // replaced rather than shrunk from the left
+        P *page_n = new P;
+        memset(page_n, 0, sizeof(P));
+        uint32_t new_id = new_page_id(leaf);
+        Key new_sep = even_out(page_l, page_r, sep, page_n);
+        page_n->right = page_r->right;
+        page_n->high_key = page_r->high_key;
+        page_l->right = new_id;
+        page_l->high_key = new_sep;
+        fa->key[i - 1] = new_sep;
+        fa->nxt[i] = new_id;
+        page_r->num_item = DEAD_PAGE;
+        set_page(new_id, page_n);
+        set_page(cur_id, page_l);
+        set_page(right_id, page_r);
+        set_node(fa_id, fa);
+        pages[right_id].lock.unlock();
+        pages[cur_id].lock.unlock();
+        pages[fa_id].lock.unlock();
+        retire_page(right_id);
     }
+};
 
-    void revert_first_down_insert_lock(std::vector<uint32_t> &x_locked, std::vector<uint32_t> &s_locked, uint32_t lock_mode, uint32_t cur_id)
+template <typename Key, typename T, size_t PageBytes>
+btree_wrapper<Key, T, PageBytes>::btree_wrapper(const btree_options_t &opt)
+    : store("./btree/btree_pages", PageBytes, opt.open_existing), cache_type(opt.cache_type),
+      scan_readahead(opt.scan_readahead), bulk_fill(opt.bulk_fill),
+      reclaimer([this](garbage &g) { reclaim(g); }),
+      checkpoint_bytes(opt.checkpoint_mb << 20), inner_in_memory(opt.inner_in_memory),
+      shadow_paging(opt.shadow_paging || opt.use_wal), delta_updates(opt.delta_updates),
+      delta_chain(std::max<uint32_t>(opt.delta_chain, 1)),
+      leaf_append(std::min<uint32_t>(opt.leaf_append, data_cap / 4)), adaptive_split(opt.adaptive_split)
+{
+    data_low = data_cap * opt.merge_threshold;
+    node_low = node_cap * opt.merge_threshold;
+    data_merge = std::min<uint32_t>(data_cap * opt.merge_fill, data_cap - 1);
+    node_merge = std::min<uint32_t>(node_cap * opt.merge_fill, node_cap - 1);
+    store.set_stats(&op_stats);
+    if (opt.huge_pages)
+    {
+        page_alloc::use_huge_pages(true);
+    }
+    if (shadow_paging)
     {
-        if (lock_mode == 0)
+        store.enable_shadow();
+    }
+    if (cache_type == 1)
+    {
+        pool.reset(new buffer_pool(store, opt.pool_mb));
+        if (opt.flush_high > 0)
         {
-            // printf("00before slock %lld\n", cur_id);
-            large_mutex[cur_id]->unlock_shared();
-            s_locked.pop_back();
-            // printf("01slock %lld\n", cur_id);
+            pool->start_flusher(opt.flush_high, opt.flush_low, opt.flush_mb_per_sec);
         }
-        else
+    }
+    else if (cache_type == 2)
+    {
+        writer.reset(new async_writer(store));
+    }
+    else if (cache_type == 3)
+    {
+        if (shadow_paging)
         {
-            // printf("%lld prelock %lld\n", k_b, cur_id);
-            large_mutex[cur_id]->unlock();
-            x_locked.pop_back();
-            // printf("%lld lock %lld\n", k_b, cur_id);
+            fprintf(stderr, "btree: mapped pages are changed in place, they cannot be shadow paged%s\n",
+                    opt.use_wal ? " as the log needs" : "");
+            abort();
         }
+        store.enable_mmap();
     }
-
-    bool up_insert_lock(std::vector<uint32_t> &x_locked, std::vector<uint32_t> &s_locked, uint32_t lock_mode, uint32_t cur_id, uint32_t nxt_id = -1)
+    if (opt.hot_keys > 0 && std::is_trivially_copyable<T>::value)
+    {
+        hot.reset(new hot_cache<Key, T>(opt.hot_keys));
+    }
+    if (opt.open_existing)
     {
-        if (nxt_id == -1)
-        { // cur_id is root
-          // do nothing
+        uint32_t root = store.open_image([&](uint32_t id, bool leaf) {
+            pages.get(id).leaf.store(leaf, std::memory_order_relaxed);
+        });
+        // a tree written in place, without shadow paging or the log, only
+        // leaves an image behind when it is closed
+        if (root == INVALID_PAGE)
+        {
+            fprintf(stderr, "btree: no tree to open in ./btree; without shadow paging or the log a tree "
+                            "can only be reopened after it was closed\n");
+            abort();
         }
-        else
+        opened_pages = store.num_pages();
+        root_id.store(root);
+        if (opt.use_wal)
         {
-            if (lock_mode == 0)
-            {
-                // printf("try lock %lld\n", nxt_id);
-                // fflush(stdout);
-                // may have problem here
-                large_mutex[nxt_id]->unlock_shared();
-                if (!large_mutex[nxt_id]->try_lock())
+            // records the image has already are harmless to apply again once
+            // an insert of a present key is taken as an update
+            wal old_log("./btree/btree_wal", true);
+            old_log.replay([&](wal::op_type type, const char *key, size_t key_sz, const char *val, size_t val_sz) {
+                if (type == wal::OP_REMOVE)
                 {
-                    // printf("try lock failed%lld\n", nxt_id);
-                    // fflush(stdout);
-                    s_locked.pop_back();
-                    return false;
+                    remove(key, key_sz);
                 }
-                else
+                else if (!update(key, key_sz, val, val_sz) && type == wal::OP_INSERT)
                 {
-                    // printf("41xlock %lld\n", *id_it);
-                    // printf("42before un xlock %lld\n", pre_id);
-                    // printf("try lock succed%lld\n", nxt_id);
-                    // fflush(stdout);
-                    // printf("43un xlock %lld\n", pre_id);
-                    s_locked.pop_back();
-                    x_locked.push_back(nxt_id);
+                    insert(key, key_sz, val, val_sz);
                 }
-            }
-            else
-            {
-                // do nothing
-            }
+            });
         }
-        return true;
     }
-};
-
-template <typename Key, typename T>
-btree_wrapper<Key, T>::btree_wrapper()
-{
-    btree_node *node = new btree_node;
-    node->nxt[0] = 1;
-    node->key[0] = 2e9;
-    node->nxt[1] = 2;
-    node->num_item = 2;
-    init_new_node(node);
-    init_new_data();
-    init_new_data();
-    root_id = 0;
+    else
+    {
+        init_tree();
+    }
+    if (shadow_paging)
+    {
+        // the initial pages are the first checkpoint
+        checkpoint();
+    }
+    if (opt.use_wal)
+    {
+        log.reset(new wal("./btree/btree_wal"));
+    }
+    if (delta_updates && cache_type != 2)
+    {
+        consolidator = std::thread(&btree_wrapper::consolidate_loop, this);
+    }
 }
 
-template <typename Key, typename T>
-btree_wrapper<Key, T>::~btree_wrapper()
+template <typename Key, typename T, size_t PageBytes>
+btree_wrapper<Key, T, PageBytes>::~btree_wrapper()
 {
-    for (auto node : nodes)
+    if (consolidator.joinable())
+    {
+        {
+            std::unique_lock lock(consolidate_mutex);
+            consolidate_stop = true;
+        }
+        consolidate_cv.notify_all();
+        consolidator.join();
+    }
+    // no operation runs any more, so nothing retired is in use; the freed
+    // pages go into the checkpoint, and so do the chains it folds
+    reclaimer.drain();
+    checkpoint(true);
+    reclaimer.drain();
+    if (tree_stats::dump_at_exit())
     {
-        fclose(node);
+        stats().print(stderr, "btree");
     }
-    for (auto m : small_mutex)
+}
+
+template <typename Key, typename T, size_t PageBytes>
+tree_stats::snapshot btree_wrapper<Key, T, PageBytes>::stats()
+{
+    tree_stats::snapshot s = op_stats.read();
+    if (pool)
     {
-        delete m;
+        s.counters[tree_stats::CACHE_HITS] += pool->hits();
+        s.counters[tree_stats::CACHE_MISSES] += pool->misses();
+        s.counters[tree_stats::FLUSHES] += pool->flushes();
+        s.counters[tree_stats::DIRTY_EVICTIONS] += pool->dirty_evictions();
     }
+    return s;
 }
 
-template <typename Key, typename T>
-bool btree_wrapper<Key, T>::find(const char *key, size_t key_sz, char *value_out)
+template <typename Key, typename T, size_t PageBytes>
+bool btree_wrapper<Key, T, PageBytes>::find(const char *key, size_t key_sz, char *value_out)
 {
+    tree_stats::timer timer(op_stats, tree_stats::FIND);
     // printf("find\n");
     Key k = *reinterpret_cast<Key *>(const_cast<char *>(key));
-    int cur_id;
+    bool succ;
+    T v;
+    uint64_t stamp = 0;
+    if (hot)
     {
-        std::shared_lock lock(root_mutex);
-        cur_id = root_id;
+        if (hot->find(k, v, stamp))
+        {
+            op_stats.add(tree_stats::HOT_HITS);
+            memcpy(value_out, &v, sizeof(T));
+            return true;
+        }
+        op_stats.add(tree_stats::HOT_MISSES);
     }
-    large_mutex[cur_id]->lock_shared();
-    while (!is_leaf[cur_id])
+    op_guard guard(this);
+    uint32_t cur_id = find_level(k, 0);
+    while (cur_id != INVALID_PAGE)
     {
-        btree_node *node = get_node(cur_id);
-        // printf("0 %lld %lld/%lld\n", cur_id, node->num_item, node_cap);
-        int pre_id = cur_id;
-        cur_id = get_nxt_id(node, k);
-        large_mutex[cur_id]->lock_shared();
-        large_mutex[pre_id]->unlock_shared();
-        delete node;
+        bool dead = false;
+        uint32_t leaf_id = cur_id; // cur_id may be set by an attempt that is then retried
+        read_optimistic<btree_data>(leaf_id, [&](const btree_data *data) {
+            if ((dead = data->num_item == DEAD_PAGE))
+            {
+                return true;
+            }
+            if (data->num_item > data_cap)
+            {
+                return false;
+            }
+            if (data->right != INVALID_PAGE && k >= data->high_key)
+            {
+                cur_id = data->right;
+                return true;
+            }
+            succ = get_nxt_val(data, k, v);
+            if (succ)
+            {
+                delta_val(leaf_id, k, v);
+            }
+            cur_id = INVALID_PAGE;
+            return true;
+        });
+        if (dead)
+        {
+            cur_id = find_level(k, 0);
+        }
     }
-    btree_data *data = get_data(cur_id);
-    bool succ;
-    T v;
-    succ = get_nxt_val(data, k, v);
-    large_mutex[cur_id]->unlock_shared();
-    delete data;
     if (!succ)
     {
-
-        // print_mutex.lock();
-        /*{
-            std::unique_lock print_lock(print_small_mutex);
-            printf("find %lld failed\n", k);
-        }*/
-        // print_state(root_id, true);
-        // print_mutex.unlock();
         return false;
     }
+    if (hot)
+    {
+        hot->admit(k, v, stamp);
+    }
     memcpy(value_out, &v, sizeof(T));
     // printf("find end\n");
     return true;
 }
 
-template <typename Key, typename T>
-bool btree_wrapper<Key, T>::insert(const char *key, size_t key_sz, const char *value, size_t value_sz)
+template <typename Key, typename T, size_t PageBytes>
+bool btree_wrapper<Key, T, PageBytes>::insert(const char *key, size_t key_sz, const char *value, size_t value_sz)
 {
+    tree_stats::timer timer(op_stats, tree_stats::INSERT);
     Key k = *reinterpret_cast<Key *>(const_cast<char *>(key));
-    for (size_t i = 0; i < 10; ++i)
+    T v = *reinterpret_cast<T *>(const_cast<char *>(value));
+    std::vector<uint32_t> path;
+    auto op = begin_op();
+    op_guard guard(this);
+    uint32_t cur_id = INVALID_PAGE;
+    if (adaptive_split)
+    {
+        cur_id = lock_append_leaf(k);
+    }
+    if (cur_id == INVALID_PAGE)
     {
-        if (i == 0)
+        while ((cur_id = lock_covering(find_level(k, 0, &path), k)) == INVALID_PAGE)
         {
-            if (insert(key, key_sz, value, value_sz, 0))
-            {
-                // printf("%lld succ in %lld time(s)\n", k, i + 1);
-                return true;
-            }
+            path.clear();
         }
-        else
+    }
+    btree_data *data = get_data(cur_id);
+    bool ascending = adaptive_split && (data->num_item == 0 || k > last_key(data));
+    if (adaptive_split)
+    {
+        note_insert(cur_id, data->key, data->num_item - data->num_appended, data_cap, k, ascending);
+    }
+    if (leaf_append > 0)
+    {
+        append_data_item(data, k, v);
+    }
+    else
+    {
+        insert_data_item(data, k, v);
+    }
+    uint64_t lsn = log_op(wal::OP_INSERT, key, key_sz, value, value_sz);
+    if (data->num_item < data_cap)
+    {
+        if (ascending)
         {
-            if (insert(key, key_sz, value, value_sz, 1))
-            {
-                // printf("%lld succ in %lld time(s)\n", k, i + 1);
-                return true;
-            }
+            append_leaf.store(cur_id, std::memory_order_release);
+        }
+        set_data(cur_id, data);
+        pages[cur_id].lock.unlock();
+    }
+    else
+    {
+        Key sep;
+        uint32_t nxt = split_data(cur_id, data, sep);
+        if (ascending)
+        {
+            // before the new page can be reached and split in turn
+            append_leaf.store(k < sep ? cur_id : nxt, std::memory_order_release);
         }
+        set_data(cur_id, data);
+        insert_parent(path, cur_id, 0, sep, nxt);
     }
-    // printf("%lld fail", key);
-    return false;
+    end_op(op, lsn);
+    return true;
 }
 
-template <typename Key, typename T>
-bool btree_wrapper<Key, T>::insert(const char *key, size_t key_sz, const char *value, size_t value_sz, size_t lock_mode)
+template <typename Key, typename T, size_t PageBytes>
+bool btree_wrapper<Key, T, PageBytes>::update(const char *key, size_t key_sz, const char *value, size_t value_sz)
 {
+    tree_stats::timer timer(op_stats, tree_stats::UPDATE);
     Key k = *reinterpret_cast<Key *>(const_cast<char *>(key));
-    Key k_b = k;
     T v = *reinterpret_cast<T *>(const_cast<char *>(value));
-    std::vector<uint32_t> cur_ids;
-    std::vector<std::pair<uint32_t, btree_data *>> uncommit_data;
-    std::vector<std::pair<uint32_t, btree_node *>> uncommit_node;
-    std::vector<uint32_t> x_locked;
-    std::vector<uint32_t> s_locked;
-    bool succ = true;
-    bool root_changed = false;
-    // printf("k%lld v %lld mode%lld\n", k, v, lock_mode);
-    //   print_state(root_id, true);
+    auto op = begin_op();
+    op_guard guard(this);
+    // updates of a page go on side by side when they only prepend deltas,
+    // unless the log must get the records of a key in the order applied
+    bool shared = delta_updates && !log;
     uint32_t cur_id;
+    while ((cur_id = lock_covering(find_level(k, 0), k, shared)) == INVALID_PAGE)
     {
-        std::shared_lock lock(root_mutex);
-        cur_id = root_id;
-    }
-    down_insert_lock(x_locked, s_locked, lock_mode, cur_id);
-    /*{
-        std::unique_lock print_lock(print_small_mutex);
-        printf("%lld slock %lld\n", k_b, cur_id);
-    }*/
-    {
-        std::shared_lock lock(root_mutex);
-        if (cur_id != root_id)
-        { // root changed
-            revert_first_down_insert_lock(x_locked, s_locked, lock_mode, cur_id);
-            /*{
-                std::unique_lock print_lock(print_small_mutex);
-                printf("%lld unlock %lld\n", k_b, cur_id);
-            }*/
-            return false;
-        }
     }
-    //  find leaf node
-
-    while (!is_leaf[cur_id])
+    bool succ;
+    uint64_t lsn = 0;
+    uint32_t depth = 0;
+    if (delta_updates)
     {
-        btree_node *node = get_node(cur_id);
-        cur_ids.push_back(cur_id);
-        int pre_id = cur_id;
-        cur_id = get_nxt_id(node, k);
-        delete node;
-        down_insert_lock(x_locked, s_locked, lock_mode, cur_id, pre_id);
-        /*{
-            std::unique_lock print_lock(print_small_mutex);
-            if (is_leaf[cur_id])
-            {
-                printf("%lld xlock %lld\n", k_b, cur_id);
-            }
-            else
+        {
+            page_ref<btree_data> data(this, cur_id);
+            succ = find_item(data.get(), k) < data->num_item;
+        }
+        if (succ)
+        {
+            lsn = log_op(wal::OP_UPDATE, key, key_sz, value, value_sz);
+            depth = push_delta(cur_id, k, v);
+            if (hot)
             {
-                printf("%lld slock %lld\n", k_b, cur_id);
+                // updates of the key may run side by side, only a drop is
+                // right whatever their order
+                hot->invalidate(k);
             }
-
-            printf("%lld unslock %lld\n", k_b, pre_id);
-        }*/
+        }
+    }
+    else
+    {
+        page_mut<btree_data> data(this, cur_id);
+        succ = set_nxt_val(data.get(), k, v);
+        if (succ)
+        {
+            data.mark_dirty();
+            lsn = log_op(wal::OP_UPDATE, key, key_sz, value, value_sz);
+        }
+    }
+    if (succ && hot && !delta_updates)
+    {
+        // the page is written back by now, the lock still orders the update
+        hot->set(k, v);
+    }
+    unlock_page(cur_id, shared);
+    if (depth >= delta_chain)
+    {
+        consolidate_later(cur_id, depth);
     }
+    end_op(op, lsn);
+    return succ;
+}
 
-    // insert
-    btree_data *data = get_data(cur_id);
-    insert_data_item(data, k, v);
-    /*{
-        std::unique_lock print_lock(print_small_mutex);
-        printf("%lld k%lld val %lld inserted to %lld\n", k_b, k, v, cur_id);
-    }*/
-    if (data->num_item < data_cap)
+template <typename Key, typename T, size_t PageBytes>
+bool btree_wrapper<Key, T, PageBytes>::remove(const char *key, size_t key_sz)
+{
+    tree_stats::timer timer(op_stats, tree_stats::REMOVE);
+    Key k = *reinterpret_cast<Key *>(const_cast<char *>(key));
+    std::vector<uint32_t> path;
+    auto op = begin_op();
+    op_guard guard(this);
+    uint32_t cur_id;
+    while ((cur_id = lock_covering(find_level(k, 0, &path), k)) == INVALID_PAGE)
     {
-        set_data(cur_id, data);
+        path.clear();
+    }
+    bool succ, underflow = false;
+    uint64_t lsn = 0;
+    {
+        page_mut<btree_data> data(this, cur_id);
+        succ = del_nxt_val(data.get(), k);
+        if (succ)
+        {
+            data.mark_dirty();
+            lsn = log_op(wal::OP_REMOVE, key, key_sz);
+            underflow = data->num_item < data_low;
+        }
+    }
+    if (succ && hot)
+    {
+        // after the page is written back, or a reader could cache it again
+        hot->invalidate(k);
+    }
+    if (underflow)
+    {
+        rebalance<btree_data>(path, cur_id);
     }
     else
     {
-        // printf("%lld 2\n",k);
-        auto id_it = cur_ids.rbegin();
-        btree_node *cur_node;
-        do
+        pages[cur_id].lock.unlock();
+    }
+    end_op(op, lsn);
+    return succ;
+}
+
+// each leaf is read consistently on its own, not the range as a whole;
+// leaves coming up are known from their parents and read ahead of the scan
+template <typename Key, typename T, size_t PageBytes>
+int btree_wrapper<Key, T, PageBytes>::scan(const char *key, size_t key_sz, int scan_sz, char *&values_out)
+{
+    tree_stats::timer timer(op_stats, tree_stats::SCAN);
+    constexpr size_t ONE_MB = 1ULL << 20;
+    constexpr size_t ITEM_SZ = sizeof(Key) + sizeof(T);
+    // on the heap: static TLS is carved out of every thread's stack, and
+    // there is a copy per instantiation
+    static thread_local std::unique_ptr<char[]> buffer(new char[ONE_MB]);
+    char *results = buffer.get();
+    Key k = *reinterpret_cast<Key *>(const_cast<char *>(key));
+    if (scan_sz > (int)(ONE_MB / ITEM_SZ))
+    {
+        scan_sz = ONE_MB / ITEM_SZ;
+    }
+    int scanned = 0;
+    op_guard guard(this);
+    Key from = k; // scanning resumes at the first key >= from, > from once it is copied
+    bool copied = false;
+    std::vector<uint32_t> leaves;
+    std::unique_ptr<btree_data> sorted;
+    uint32_t fa_right;
+    do
+    { // the parent may be merged away before we get to it
+        fa_right = collect_leaves(find_level(k, 1), k, false, leaves);
+    } while (leaves.empty());
+    size_t pos = 0, ahead = 1; // leaves[pos] is being read, leaves[..ahead) were prefetched
+    uint32_t cur_id = leaves[0];
+    while (cur_id != INVALID_PAGE && scanned < scan_sz)
+    {
+        if (scan_readahead > 0)
         {
-            if (up_insert_lock(x_locked, s_locked, lock_mode, cur_id, *id_it))
+            while (ahead < leaves.size() && ahead <= pos + scan_readahead)
             {
-                /*{
-                    std::unique_lock print_lock(print_small_mutex);
-                    printf("%lld xlock %lld\n", k_b, *id_it);
-                }*/
-                btree_node *nxt_node = get_node(*id_it);
-                if (id_it == cur_ids.rbegin())
-                {
-                    split_data(data, nxt_node);
-                    /*{
-                        std::unique_lock print_lock(print_small_mutex);
-                        printf("%lld k%lld split to %lld\n", k_b, cur_id, *id_it);
-                    }*/
-                    uncommit_data.push_back({cur_id, data});
-                    uncommit_node.push_back({*id_it, nxt_node});
-                }
-                else
-                {
-                    split_node(cur_node, nxt_node);
-                    /*{
-                        std::unique_lock print_lock(print_small_mutex);
-                        printf("%lld k%lld split to %lld\n", k_b, cur_id, *id_it);
-                    }*/
-                    uncommit_node.push_back({*id_it, nxt_node});
-                }
-                cur_node = nxt_node;
-                cur_id = *id_it;
+                prefetch_page(leaves[ahead++]);
             }
-            else
+            if (ahead <= pos + scan_readahead && fa_right != INVALID_PAGE)
             {
-                succ = false;
-                break;
+                fa_right = collect_leaves(fa_right, k, true, leaves);
             }
-            ++id_it;
-        } while (cur_node->num_item == node_cap && id_it != cur_ids.rend());
-        if (succ && cur_node->num_item == node_cap)
-        { // root is full
-            btree_node *nxt_node = new btree_node;
-            nxt_node->nxt[0] = root_id;
-            nxt_node->num_item = 1;
-            split_node(cur_node, nxt_node);
-            uint32_t new_root_id = init_new_node(nxt_node);
-            // printf("%lld prelock %lld\n", k_b, new_root_id);
-            large_mutex[new_root_id]->lock();
-            // printf("%lld lock %lld\n", k_b, new_root_id);
-            x_locked.push_back(new_root_id);
-
-            root_mutex.lock();
-            root_changed = true;
+        }
+        uint32_t nxt_id;
+        int cnt = 0;
+        bool dead = false;
+        read_optimistic<btree_data>(cur_id, [&](const btree_data *data) {
+            // the page may change under us, its counts are read once
+            uint32_t num_item = read_once(data->num_item), num_appended = read_once(data->num_appended);
+            if ((dead = num_item == DEAD_PAGE))
             {
-                std::unique_lock print_lock(print_small_mutex);
-                // printf("%lld root id change from %lld to %lld\n", k_b, root_id, new_root_id);
+                return true;
+            }
+            if (num_item > data_cap || num_appended > num_item)
+            {
+                return false;
+            }
+            if (num_appended > 0)
+            { // the page stays as it is, its items are put in order in a copy
+                if (!sorted)
+                {
+                    sorted.reset(new btree_data);
+                }
+                memcpy(sorted.get(), data, sizeof(btree_data));
+                sorted->num_item = num_item;
+                sorted->num_appended = num_appended;
+                sort_appended(sorted.get());
+                data = sorted.get();
+            }
+            size_t i = copied ? node_search::upper_index(data->key, num_item, from)
+                              : node_search::lower_index(data->key, num_item, from);
+            size_t first = i;
+            char *dst = results + scanned * ITEM_SZ;
+            for (cnt = 0; i < num_item && scanned + cnt < scan_sz; ++i, ++cnt)
+            {
+                memcpy(dst, &data->key[i], sizeof(Key));
+                memcpy(dst + sizeof(Key), &data->val[i], sizeof(T));
+                dst += ITEM_SZ;
             }
-            root_id = new_root_id;
+            for_deltas(cur_id, [&](const delta &d) {
+                size_t j = node_search::lower_index(data->key, num_item, d.key);
+                if (j >= first && j < first + cnt && data->key[j] == d.key)
+                {
+                    memcpy(results + (scanned + j - first) * ITEM_SZ + sizeof(Key), &d.val, sizeof(T));
+                }
+            });
+            nxt_id = data->right;
+            return true;
+        });
+        if (dead)
+        { // merged into its left sibling meanwhile
+            cur_id = find_level(from, 0);
+            continue;
         }
-    }
-    if (succ)
-    {
-        for (auto id_data : uncommit_data)
+        if (cnt > 0)
         {
-            // printf("%lld update %lld\n", k_b, id_data.first);
-            set_data(id_data.first, id_data.second);
+            memcpy(&from, results + (scanned + cnt - 1) * ITEM_SZ, sizeof(Key));
+            copied = true;
         }
-        for (auto id_node : uncommit_node)
+        scanned += cnt;
+        cur_id = nxt_id;
+        // leaves split off after collect_leaves are not in the list, keep
+        // the position then and catch up at the next known leaf
+        for (size_t i = pos + 1; i < leaves.size() && i <= pos + scan_readahead + 1; ++i)
         {
-            // printf("%lld update %lld\n", k_b, id_node.first);
-            set_node(id_node.first, id_node.second);
+            if (leaves[i] == cur_id)
+            {
+                pos = i;
+                break;
+            }
         }
     }
-    for (auto it = x_locked.rbegin(); it != x_locked.rend(); ++it)
+    values_out = results;
+    return scanned;
+}
+
+// leaves are packed left to right into the two initial leaves and then new
+// pages, each inner level is built from the lowest keys of the one below,
+// and the top one is written over the initial root
+template <typename Key, typename T, size_t PageBytes>
+template <typename F>
+size_t btree_wrapper<Key, T, PageBytes>::bulk_load(F &&next, double fill)
+{
+    if (fill <= 0)
     {
-        // printf("51before un xlock %lld\n", id);
-        large_mutex[*it]->unlock();
-        /*{
-            std::unique_lock print_lock(print_small_mutex);
-            //printf("%lld unxlock %lld\n", k_b, *it);
-        }*/
-        // printf("%lld unlock %lld\n", k_b, id);
-        //   printf("52un xlock %lld\n", id);
+        fill = bulk_fill;
     }
-    for (auto it = s_locked.rbegin(); it != s_locked.rend(); ++it)
+    if (store.num_pages() != 3 || page_ref<btree_data>(this, 1)->num_item != 0 ||
+        page_ref<btree_data>(this, 2)->num_item != 0)
     {
-        // printf("51before un xlock %lld\n", id);
-        large_mutex[*it]->unlock_shared();
-        /*{
-            std::unique_lock print_lock(print_small_mutex);
-            printf("%lld unslock %lld\n", k_b, *it);
-        }*/
-        // printf("%lld unlock %lld\n", k_b, id);
-        //   printf("52un xlock %lld\n", id);
+        fprintf(stderr, "btree: bulk_load needs an empty tree\n");
+        return 0;
     }
-    if (root_changed)
+    uint32_t per_leaf = std::clamp<uint32_t>(data_cap * fill, 1, data_cap - 1);
+    uint32_t per_node = std::clamp<uint32_t>(node_cap * fill, 4, node_cap - 1);
+    // pages are written in id order
+    store.advise(true);
+    // (lowest key, id) of the pages on the level just built
+    std::vector<std::pair<Key, uint32_t>> level_pages;
+    btree_data *cur = new btree_data;
+    memset(cur, 0, sizeof(btree_data));
+    uint32_t cur_id = 1;
+    size_t total = 0;
+    Key k;
+    T v;
+    while (next(k, v))
     {
-        root_mutex.unlock();
+        if (cur->num_item == per_leaf)
+        {
+            uint32_t nxt_id = level_pages.empty() ? 2 : new_page_id(true);
+            cur->right = nxt_id;
+            cur->high_key = k;
+            level_pages.push_back({cur->key[0], cur_id});
+            set_data(cur_id, cur);
+            cur = new btree_data;
+            memset(cur, 0, sizeof(btree_data));
+            cur_id = nxt_id;
+        }
+        cur->key[cur->num_item] = k;
+        cur->val[cur->num_item] = v;
+        ++cur->num_item;
+        ++total;
     }
-    if (succ)
+    if (level_pages.empty())
     {
-        /*print_mutex.lock();
+        // the root needs two children, halve the only leaf
+        if (cur->num_item < 2)
         {
-            std::unique_lock print_lock(print_small_mutex);
-            printf("state of %lld\n", k_b);
+            if (cur->num_item == 1)
+            {
+                insert(reinterpret_cast<char *>(&cur->key[0]), sizeof(Key), reinterpret_cast<char *>(&cur->val[0]), sizeof(T));
+            }
+            delete cur;
+            store.advise(false);
+            return total;
         }
-        print_state(root_id, true);
-        print_mutex.unlock();*/
+        uint32_t half = cur->num_item / 2;
+        btree_data *data_r = new btree_data;
+        memset(data_r, 0, sizeof(btree_data));
+        memcpy(data_r->key, cur->key + half, (cur->num_item - half) * sizeof(Key));
+        memcpy(data_r->val, cur->val + half, (cur->num_item - half) * sizeof(T));
+        data_r->num_item = cur->num_item - half;
+        cur->num_item = half;
+        cur->right = 2;
+        cur->high_key = data_r->key[0];
+        level_pages.push_back({cur->key[0], cur_id});
+        set_data(cur_id, cur);
+        cur = data_r;
+        cur_id = 2;
     }
+    cur->right = INVALID_PAGE;
+    level_pages.push_back({cur->key[0], cur_id});
+    set_data(cur_id, cur);
 
-    return succ;
-}
-
-template <typename Key, typename T>
-bool btree_wrapper<Key, T>::update(const char *key, size_t key_sz, const char *value, size_t value_sz)
-{
-    Key k = *reinterpret_cast<Key *>(const_cast<char *>(key));
-    T v = *reinterpret_cast<T *>(const_cast<char *>(value));
-    int cur_id;
-    {
-        std::shared_lock lock(root_mutex);
-        cur_id = root_id;
-    }
-    large_mutex[cur_id]->lock_shared();
-    while (!is_leaf[cur_id])
+    for (uint32_t level = 1;; ++level)
     {
-        btree_node *node = get_node(cur_id);
-        // printf("0 %lld %lld/%lld\n", cur_id, node->num_item, node_cap);
-        int pre_id = cur_id;
-        cur_id = get_nxt_id(node, k);
-        if (!is_leaf[cur_id])
+        size_t n = level_pages.size();
+        bool top = n <= per_node;
+        size_t num = top ? 1 : (n + per_node - 1) / per_node;
+        std::vector<uint32_t> ids(num);
+        for (size_t i = 0; i < num; ++i)
         {
-            large_mutex[cur_id]->lock_shared();
+            ids[i] = top ? 0 : new_page_id(false);
         }
-        else
+        std::vector<std::pair<Key, uint32_t>> upper;
+        for (size_t i = 0, c = 0; i < num; ++i)
+        {
+            size_t cnt = std::min<size_t>(per_node, n - c);
+            if (n - c - cnt == 1)
+            { // leave two children for the last node
+                --cnt;
+            }
+            btree_node *node = new btree_node;
+            memset(node, 0, sizeof(btree_node));
+            for (size_t j = 0; j < cnt; ++j)
+            {
+                node->nxt[j] = level_pages[c + j].second;
+                if (j > 0)
+                {
+                    node->key[j - 1] = level_pages[c + j].first;
+                }
+            }
+            node->num_item = cnt;
+            node->level = level;
+            node->right = INVALID_PAGE;
+            if (i + 1 < num)
+            {
+                node->right = ids[i + 1];
+                node->high_key = level_pages[c + cnt].first;
+            }
+            upper.push_back({level_pages[c].first, ids[i]});
+            set_node(ids[i], node);
+            c += cnt;
+        }
+        if (top)
         {
-            large_mutex[cur_id]->lock();
+            break;
         }
-        large_mutex[pre_id]->unlock_shared();
-        delete node;
+        level_pages.swap(upper);
     }
-    btree_data *data = get_data(cur_id);
-    bool succ;
-    succ = set_nxt_val(data, k, v);
-    set_data(cur_id, data);
-    large_mutex[cur_id]->unlock();
-    return succ;
+    root_id.store(0, std::memory_order_release);
+    store.advise(false);
+    if (log || shadow_paging)
+    {
+        // the log does not cover the loaded pages
+        checkpoint();
+    }
+    return total;
 }
 
-template <typename Key, typename T>
-bool btree_wrapper<Key, T>::remove(const char *key, size_t key_sz)
+template <typename Key, typename T, size_t PageBytes>
+template <typename F>
+size_t btree_wrapper<Key, T, PageBytes>::bulk_load_unsorted(F &&next, size_t run_items, double fill)
 {
-    Key k = *reinterpret_cast<Key *>(const_cast<char *>(key));
-    int cur_id;
+    auto by_key = [](const std::pair<Key, T> &a, const std::pair<Key, T> &b) {
+        return a.first < b.first;
+    };
+    std::vector<std::pair<Key, T>> buf;
+    std::vector<FILE *> runs;
+    auto spill = [&] {
+        std::sort(buf.begin(), buf.end(), by_key);
+        std::string file_name = "./btree/bulk_run_" + std::to_string(runs.size());
+        FILE *f = fopen(file_name.c_str(), "wb+");
+        if (f == nullptr)
+        {
+            fprintf(stderr, "btree: cannot open %s\n", file_name.c_str());
+            abort();
+        }
+        unlink(file_name.c_str()); // gone once closed
+        for (auto &p : buf)
+        {
+            if (fwrite(&p.first, sizeof(Key), 1, f) != 1 || fwrite(&p.second, sizeof(T), 1, f) != 1)
+            {
+                fprintf(stderr, "btree: I/O error in bulk_load\n");
+                abort();
+            }
+        }
+        rewind(f);
+        runs.push_back(f);
+        buf.clear();
+    };
+    Key k;
+    T v;
+    while (next(k, v))
+    {
+        buf.emplace_back(k, v);
+        if (buf.size() == run_items)
+        {
+            spill();
+        }
+    }
+    if (runs.empty())
     {
-        std::shared_lock lock(root_mutex);
-        cur_id = root_id;
+        std::sort(buf.begin(), buf.end(), by_key);
+        size_t i = 0;
+        return bulk_load([&](Key &k, T &v) {
+            if (i == buf.size())
+            {
+                return false;
+            }
+            k = buf[i].first;
+            v = buf[i].second;
+            ++i;
+            return true;
+        }, fill);
     }
-    large_mutex[cur_id]->lock_shared();
-    while (!is_leaf[cur_id])
+    if (!buf.empty())
     {
-        btree_node *node = get_node(cur_id);
-        // printf("0 %lld %lld/%lld\n", cur_id, node->num_item, node_cap);
-        int pre_id = cur_id;
-        cur_id = get_nxt_id(node, k);
-        if (!is_leaf[cur_id])
+        spill();
+    }
+    // k-way merge of the runs, smallest head first
+    std::vector<std::pair<Key, T>> head(runs.size());
+    auto greater = [&](size_t a, size_t b) {
+        return head[b].first < head[a].first;
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> heap(greater);
+    auto pull = [&](size_t r) {
+        if (fread(&head[r].first, sizeof(Key), 1, runs[r]) == 1 && fread(&head[r].second, sizeof(T), 1, runs[r]) == 1)
         {
-            large_mutex[cur_id]->lock_shared();
+            heap.push(r);
         }
-        else
+    };
+    for (size_t r = 0; r < runs.size(); ++r)
+    {
+        pull(r);
+    }
+    size_t total = bulk_load([&](Key &k, T &v) {
+        if (heap.empty())
         {
-            large_mutex[cur_id]->lock();
+            return false;
         }
-        large_mutex[pre_id]->unlock_shared();
-        delete node;
+        size_t r = heap.top();
+        heap.pop();
+        k = head[r].first;
+        v = head[r].second;
+        pull(r);
+        return true;
+    }, fill);
+    for (auto f : runs)
+    {
+        fclose(f);
     }
-    btree_data *data = get_data(cur_id);
-    bool succ;
-    succ = del_nxt_val(data, k);
-    set_data(cur_id, data);
-    large_mutex[cur_id]->unlock();
-    return succ;
-}
-
-template <typename Key, typename T>
-int btree_wrapper<Key, T>::scan(const char *key, size_t key_sz, int scan_sz, char *&values_out)
-{
-    std::shared_lock lock(mutex_);
-    return scan_sz;
+    return total;
 }
 
-#endif
\ No newline at end of file
+#endif
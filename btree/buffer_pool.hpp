@@ -0,0 +1,550 @@
+#ifndef __BUFFER_POOL_HPP__
+#define __BUFFER_POOL_HPP__
+
+#include "page_store.hpp"
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+// Fixed set of page frames over a page_store, shared by all threads.
+// Replacement is CLOCK where the reference bit is only set on a re-access,
+// so pages touched once by a scan are the first ones to go.
+// An optional flusher thread writes dirty frames back ahead of the clock
+// hand, so misses find clean frames and need not write one back first.
+class buffer_pool
+{
+public:
+    static constexpr uint32_t INVALID_PAGE = page_store::INVALID_PAGE;
+
+    struct frame
+    {
+        std::atomic<uint32_t> page_id{INVALID_PAGE};
+        std::atomic<int32_t> pin_count{0}; // -1 while the frame is being evicted
+        std::atomic<uint64_t> version{0};  // odd while the frame is loaded, evicted or latched exclusively
+        std::atomic<bool> dirty{false};
+        std::atomic<bool> referenced{false};
+        std::shared_mutex latch; // guards the page contents
+        char *data = nullptr;
+    };
+
+    buffer_pool(page_store &store, size_t pool_mb, size_t num_shards = 64)
+        : store(store), page_sz(store.page_size()), shards(num_shards),
+          table(new std::atomic<std::atomic<uint32_t> *>[1u << (32 - SEG_BITS)]())
+    {
+        num_frames = (pool_mb << 20) / page_sz;
+        if (num_frames < 16)
+        {
+            num_frames = 16;
+        }
+        buf = static_cast<char *>(aligned_alloc(page_sz, num_frames * page_sz));
+        if (buf == nullptr)
+        {
+            fprintf(stderr, "buffer_pool: cannot allocate %zu frames\n", num_frames);
+            abort();
+        }
+        frames = new frame[num_frames];
+        for (size_t i = 0; i < num_frames; ++i)
+        {
+            frames[i].data = buf + i * page_sz;
+        }
+    }
+
+    ~buffer_pool()
+    {
+        if (flusher.joinable())
+        {
+            {
+                std::unique_lock lock(flusher_mutex);
+                flusher_stop = true;
+            }
+            flusher_cv.notify_one();
+            flusher.join();
+        }
+        flush_all();
+        delete[] frames;
+        free(buf);
+        for (size_t i = 0; i < (1u << (32 - SEG_BITS)); ++i)
+        {
+            delete[] table[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    // pinned frame with its latch held shared, contents valid
+    frame *pin_shared(uint32_t id)
+    {
+        frame *f = fetch(id, true);
+        f->latch.lock_shared();
+        return f;
+    }
+
+    // pinned frame with its latch held exclusively; with load == false the
+    // caller overwrites the whole page and the old contents are not read
+    frame *pin_exclusive(uint32_t id, bool load = true)
+    {
+        bool latched = false;
+        frame *f = fetch(id, load, &latched);
+        if (!latched)
+        {
+            f->latch.lock();
+            f->version.fetch_add(1, std::memory_order_acquire);
+        }
+        return f;
+    }
+
+    void unpin_shared(frame *f)
+    {
+        f->latch.unlock_shared();
+        f->pin_count.fetch_sub(1, std::memory_order_release);
+    }
+
+    void unpin_exclusive(frame *f, bool dirty = true)
+    {
+        if (dirty && !f->dirty.exchange(true, std::memory_order_relaxed) &&
+            num_dirty.fetch_add(1, std::memory_order_relaxed) + 1 == high_dirty)
+        {
+            flusher_cv.notify_one();
+        }
+        f->version.fetch_add(1, std::memory_order_release);
+        f->latch.unlock();
+        f->pin_count.fetch_sub(1, std::memory_order_release);
+    }
+
+    // optimistic access without pin or latch: the contents of a resident
+    // page, or nullptr when it is not resident or being written; whatever is
+    // read from it only counts if validate() succeeds afterwards
+    const char *peek(uint32_t id, uint64_t &version)
+    {
+        uint32_t idx = frame_of(id);
+        if (idx == INVALID_PAGE)
+        {
+            return nullptr;
+        }
+        frame &f = frames[idx];
+        version = f.version.load(std::memory_order_acquire);
+        if ((version & 1) || f.page_id.load(std::memory_order_relaxed) != id)
+        {
+            return nullptr;
+        }
+        if (!f.referenced.load(std::memory_order_relaxed))
+        {
+            f.referenced.store(true, std::memory_order_relaxed);
+        }
+        return f.data;
+    }
+
+    bool validate(const char *data, uint64_t version)
+    {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return frames[(data - buf) / page_sz].version.load(std::memory_order_relaxed) == version;
+    }
+
+    // start reading a page that is about to be pinned, unless it is resident
+    void prefetch(uint32_t id)
+    {
+        if (frame_of(id) == INVALID_PAGE)
+        {
+            store.prefetch(id);
+        }
+    }
+
+    // write frames back in the background once high of them are dirty,
+    // until no more than low are, at up to mb_per_sec (0: no limit)
+    void start_flusher(double high, double low, size_t mb_per_sec)
+    {
+        high_dirty = std::max<size_t>(num_frames * high, 1);
+        low_dirty = std::min<size_t>(num_frames * low, high_dirty - 1);
+        bytes_per_sec = mb_per_sec << 20;
+        flusher = std::thread(&buffer_pool::flush_loop, this);
+    }
+
+    // write every dirty frame back to the page store
+    void flush_all()
+    {
+        // no older copy written by the flusher may land after ours
+        std::unique_lock flushing(flush_mutex);
+        for (size_t i = 0; i < num_frames; ++i)
+        {
+            frame &f = frames[i];
+            if (!f.dirty.load(std::memory_order_relaxed) || !try_pin(f))
+            {
+                continue;
+            }
+            uint32_t id = f.page_id.load(std::memory_order_relaxed);
+            if (id != INVALID_PAGE)
+            {
+                std::shared_lock latch(f.latch);
+                if (f.dirty.exchange(false))
+                {
+                    num_dirty.fetch_sub(1, std::memory_order_relaxed);
+                    store.write(id, f.data, page_sz);
+                    writebacks.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+            f.pin_count.fetch_sub(1, std::memory_order_release);
+        }
+    }
+
+    size_t capacity() const
+    {
+        return num_frames;
+    }
+
+    uint64_t hits()
+    {
+        uint64_t n = 0;
+        for (auto &s : shards)
+        {
+            n += s.hits.load(std::memory_order_relaxed);
+        }
+        return n;
+    }
+
+    uint64_t misses()
+    {
+        uint64_t n = 0;
+        for (auto &s : shards)
+        {
+            n += s.misses.load(std::memory_order_relaxed);
+        }
+        return n;
+    }
+
+    uint64_t evictions()
+    {
+        return evicts.load(std::memory_order_relaxed);
+    }
+
+    uint64_t write_backs()
+    {
+        return writebacks.load(std::memory_order_relaxed);
+    }
+
+    // pages written back by the flusher, and by misses evicting a dirty frame
+    uint64_t flushes()
+    {
+        return flushed.load(std::memory_order_relaxed);
+    }
+
+    uint64_t dirty_evictions()
+    {
+        return dirty_evicts.load(std::memory_order_relaxed);
+    }
+
+private:
+    // misses of the same page id serialize on its shard
+    struct alignas(64) shard
+    {
+        std::mutex mutex;
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+    };
+
+    // page table: page id -> frame index, in segments of 1 << SEG_BITS ids
+    // allocated on first use, so lookups never take a lock
+    static constexpr uint32_t SEG_BITS = 16;
+    static constexpr int FLUSHER_NICE = 10;
+
+    page_store &store;
+    size_t page_sz;
+    size_t num_frames;
+    char *buf;
+    frame *frames;
+    std::vector<shard> shards;
+    std::unique_ptr<std::atomic<std::atomic<uint32_t> *>[]> table;
+    alignas(64) std::atomic<uint64_t> hand{0};
+    std::atomic<uint64_t> evicts{0};
+    std::atomic<uint64_t> writebacks{0};
+    std::atomic<uint64_t> flushed{0};
+    std::atomic<uint64_t> dirty_evicts{0};
+    // flusher: it is woken when num_dirty reaches high_dirty and holds
+    // flush_mutex while it writes a page
+    alignas(64) std::atomic<size_t> num_dirty{0};
+    size_t high_dirty = SIZE_MAX, low_dirty = 0;
+    uint64_t bytes_per_sec = 0;
+    std::thread flusher;
+    std::mutex flusher_mutex, flush_mutex;
+    std::condition_variable flusher_cv;
+    bool flusher_stop = false;
+
+    shard &shard_of(uint32_t id)
+    {
+        return shards[id % shards.size()];
+    }
+
+    uint32_t frame_of(uint32_t id)
+    {
+        std::atomic<uint32_t> *seg = table[id >> SEG_BITS].load(std::memory_order_acquire);
+        if (seg == nullptr)
+        {
+            return INVALID_PAGE;
+        }
+        return seg[id & ((1u << SEG_BITS) - 1)].load(std::memory_order_acquire);
+    }
+
+    std::atomic<uint32_t> &table_slot(uint32_t id)
+    {
+        auto &dir = table[id >> SEG_BITS];
+        std::atomic<uint32_t> *seg = dir.load(std::memory_order_acquire);
+        if (seg == nullptr)
+        {
+            std::atomic<uint32_t> *fresh = new std::atomic<uint32_t>[1u << SEG_BITS];
+            for (size_t i = 0; i < (1u << SEG_BITS); ++i)
+            {
+                fresh[i].store(INVALID_PAGE, std::memory_order_relaxed);
+            }
+            if (dir.compare_exchange_strong(seg, fresh, std::memory_order_acq_rel))
+            {
+                seg = fresh;
+            }
+            else
+            {
+                delete[] fresh;
+            }
+        }
+        return seg[id & ((1u << SEG_BITS) - 1)];
+    }
+
+    bool try_pin(frame &f)
+    {
+        int32_t c = f.pin_count.load(std::memory_order_relaxed);
+        while (c >= 0)
+        {
+            if (f.pin_count.compare_exchange_weak(c, c + 1, std::memory_order_acquire))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // pins the frame of page id if it is resident
+    frame *try_hit(uint32_t id)
+    {
+        uint32_t idx = frame_of(id);
+        if (idx == INVALID_PAGE)
+        {
+            return nullptr;
+        }
+        frame &f = frames[idx];
+        if (!try_pin(f))
+        {
+            return nullptr;
+        }
+        if (f.page_id.load(std::memory_order_acquire) != id)
+        { // the frame was reused for another page meanwhile
+            f.pin_count.fetch_sub(1, std::memory_order_release);
+            return nullptr;
+        }
+        if (!f.referenced.load(std::memory_order_relaxed))
+        {
+            f.referenced.store(true, std::memory_order_relaxed);
+        }
+        return &f;
+    }
+
+    // returns the frame of page id pinned; when the page had to be brought in,
+    // *latched tells whether the exclusive latch taken for loading is still held
+    frame *fetch(uint32_t id, bool load, bool *latched = nullptr)
+    {
+        shard &s = shard_of(id);
+        while (true)
+        {
+            if (frame *f = try_hit(id))
+            {
+                s.hits.fetch_add(1, std::memory_order_relaxed);
+                return f;
+            }
+            if (frame_of(id) != INVALID_PAGE)
+            {
+                // resident but being evicted or brought in by someone else
+                std::this_thread::yield();
+                continue;
+            }
+            frame *f = claim_victim();
+            std::unique_lock lock(s.mutex);
+            if (frame_of(id) != INVALID_PAGE)
+            {
+                lock.unlock();
+                f->version.fetch_add(1, std::memory_order_release);
+                f->pin_count.store(0, std::memory_order_release);
+                continue;
+            }
+            f->latch.lock();
+            f->page_id.store(id, std::memory_order_relaxed);
+            f->dirty.store(false, std::memory_order_relaxed);
+            f->referenced.store(false, std::memory_order_relaxed);
+            f->pin_count.store(1, std::memory_order_release);
+            table_slot(id).store(f - frames, std::memory_order_release);
+            s.misses.fetch_add(1, std::memory_order_relaxed);
+            lock.unlock();
+            if (load)
+            {
+                store.read(id, f->data, page_sz);
+            }
+            if (latched != nullptr)
+            {
+                // stays odd until unpin_exclusive
+                *latched = true;
+            }
+            else
+            {
+                f->version.fetch_add(1, std::memory_order_release);
+                f->latch.unlock();
+            }
+            return f;
+        }
+    }
+
+    // returns an unmapped frame with pin_count == -1 and an odd version
+    frame *claim_victim()
+    {
+        for (size_t step = 1;; ++step)
+        {
+            frame &f = frames[hand.fetch_add(1, std::memory_order_relaxed) % num_frames];
+            if (step % (2 * num_frames) == 0)
+            {
+                std::this_thread::yield();
+            }
+            if (f.pin_count.load(std::memory_order_relaxed) != 0)
+            {
+                continue;
+            }
+            if (f.referenced.exchange(false, std::memory_order_relaxed))
+            {
+                continue;
+            }
+            if (flusher.joinable() && step <= num_frames && f.dirty.load(std::memory_order_relaxed) &&
+                num_dirty.load(std::memory_order_relaxed) < high_dirty)
+            { // the flusher keeps up and gets to it, a clean frame comes up first
+                continue;
+            }
+            int32_t zero = 0;
+            if (!f.pin_count.compare_exchange_strong(zero, -1, std::memory_order_acquire))
+            {
+                continue;
+            }
+            f.version.fetch_add(1, std::memory_order_acquire);
+            uint32_t old = f.page_id.load(std::memory_order_relaxed);
+            if (old != INVALID_PAGE)
+            {
+                if (f.dirty.exchange(false))
+                {
+                    num_dirty.fetch_sub(1, std::memory_order_relaxed);
+                    store.write(old, f.data, page_sz);
+                    writebacks.fetch_add(1, std::memory_order_relaxed);
+                    dirty_evicts.fetch_add(1, std::memory_order_relaxed);
+                }
+                // readers spin on the mapping until the write-back is done
+                uint32_t idx = &f - frames;
+                table_slot(old).compare_exchange_strong(idx, INVALID_PAGE, std::memory_order_release);
+                f.page_id.store(INVALID_PAGE, std::memory_order_relaxed);
+                evicts.fetch_add(1, std::memory_order_relaxed);
+            }
+            return &f;
+        }
+    }
+
+    void flush_loop()
+    {
+        using clock = std::chrono::steady_clock;
+        std::unique_ptr<char, decltype(&free)> copy(static_cast<char *>(aligned_alloc(page_sz, page_sz)), &free);
+        clock::time_point next = clock::now();
+        // it yields the CPU to operations rather than compete for it
+        setpriority(PRIO_PROCESS, syscall(SYS_gettid), FLUSHER_NICE);
+        std::unique_lock lock(flusher_mutex);
+        while (!flusher_stop)
+        {
+            if (num_dirty.load(std::memory_order_relaxed) < high_dirty)
+            {
+                flusher_cv.wait_for(lock, std::chrono::milliseconds(10));
+                continue;
+            }
+            lock.unlock();
+            // from the frames the hand gets to next, the ones not in use
+            // lately first
+            size_t start = hand.load(std::memory_order_relaxed), i = 0;
+            while (num_dirty.load(std::memory_order_relaxed) > low_dirty && i < 2 * num_frames)
+            {
+                if (i == num_frames && num_dirty.load(std::memory_order_relaxed) < high_dirty)
+                { // the rest are in use and likely to be written again soon
+                    break;
+                }
+                frame &f = frames[(start + i) % num_frames];
+                bool cold = i < num_frames;
+                ++i;
+                if (cold && f.referenced.load(std::memory_order_relaxed))
+                {
+                    continue;
+                }
+                if (!flush_frame(f, copy.get()))
+                {
+                    continue;
+                }
+                if (bytes_per_sec > 0)
+                {
+                    // pace the writes, sleeping once ahead by a millisecond
+                    clock::time_point now = clock::now();
+                    next = std::max(next, now - std::chrono::milliseconds(1)) +
+                           std::chrono::nanoseconds(page_sz * 1000000000ull / bytes_per_sec);
+                    if (next > now + std::chrono::milliseconds(1))
+                    {
+                        std::this_thread::sleep_until(next);
+                    }
+                }
+            }
+            lock.lock();
+            if (num_dirty.load(std::memory_order_relaxed) > low_dirty && !flusher_stop)
+            { // what is left is pinned or being written, give it a moment
+                flusher_cv.wait_for(lock, std::chrono::milliseconds(1));
+            }
+        }
+    }
+
+    // write a dirty frame back from a copy, so writers of the page need not
+    // wait for the I/O; the pin keeps the frame from being evicted meanwhile
+    bool flush_frame(frame &f, char *copy)
+    {
+        if (!f.dirty.load(std::memory_order_relaxed) || !try_pin(f))
+        {
+            return false;
+        }
+        bool wrote = false;
+        uint32_t id = f.page_id.load(std::memory_order_relaxed);
+        if (id != INVALID_PAGE)
+        {
+            std::unique_lock flushing(flush_mutex);
+            {
+                std::shared_lock latch(f.latch);
+                if ((wrote = f.dirty.exchange(false)))
+                {
+                    memcpy(copy, f.data, page_sz);
+                    num_dirty.fetch_sub(1, std::memory_order_relaxed);
+                }
+            }
+            if (wrote)
+            {
+                store.write(id, copy, page_sz);
+                writebacks.fetch_add(1, std::memory_order_relaxed);
+                flushed.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        f.pin_count.fetch_sub(1, std::memory_order_release);
+        return wrote;
+    }
+};
+
+#endif
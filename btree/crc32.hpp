@@ -0,0 +1,35 @@
+#ifndef __CRC32_HPP__
+#define __CRC32_HPP__
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC-32 (IEEE), crc carries the value over a previous chunk
+inline uint32_t crc32(const void *data, size_t len, uint32_t crc = 0)
+{
+    static const struct table_t
+    {
+        uint32_t t[256];
+        table_t()
+        {
+            for (uint32_t i = 0; i < 256; ++i)
+            {
+                uint32_t c = i;
+                for (int j = 0; j < 8; ++j)
+                {
+                    c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                }
+                t[i] = c;
+            }
+        }
+    } table;
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    crc = ~crc;
+    for (size_t i = 0; i < len; ++i)
+    {
+        crc = table.t[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#endif
@@ -0,0 +1,212 @@
+#ifndef __EPOCH_HPP__
+#define __EPOCH_HPP__
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <cstdint>
+
+// Epoch-based reclamation. An operation that may reach shared memory without
+// a lock holds a guard, which takes one of SLOTS slots and announces the
+// global epoch in it. What a writer unlinks is retired into the limbo list of
+// its slot, tagged with the epoch, and freed once the epoch is two further:
+// the epoch only moves on when every held slot announces the current one, so
+// by then no guard is left that could have reached the item.
+//
+// Slots belong to guards rather than threads: a guard takes the first free
+// slot from a hint of its thread, so threads come and go without registering
+// and a guard costs a store to a line other threads rarely touch. Whoever
+// holds a slot owns its limbo list, and what a thread retires goes to the
+// slot of its guard. A guard leaving items in its list moves the epoch on and
+// frees what it can on its way out, and whoever moves the epoch on frees the
+// items of slots nobody holds, so those of a thread that stopped get freed.
+template <typename Item>
+class epoch_reclaimer
+{
+public:
+    // the innermost guard of a thread
+    struct held
+    {
+        epoch_reclaimer *r = nullptr;
+        size_t s = 0;
+    };
+
+    class guard
+    {
+    public:
+        // no-op without a reclaimer
+        guard(epoch_reclaimer *r) : r(r)
+        {
+            if (r != nullptr)
+            {
+                s = r->enter();
+                outer = current;
+                current = {r, s};
+            }
+        }
+        ~guard()
+        {
+            if (r != nullptr)
+            {
+                current = outer;
+                r->exit(s);
+            }
+        }
+        guard(const guard &) = delete;
+        guard &operator=(const guard &) = delete;
+
+    private:
+        epoch_reclaimer *r;
+        size_t s = 0; // slot held
+        held outer;   // the guard of the thread this one is nested in
+    };
+
+    // fn frees an item once no guard can reach it
+    epoch_reclaimer(std::function<void(Item &)> fn) : reclaim(std::move(fn)), slots(new slot[SLOTS])
+    {
+    }
+
+    ~epoch_reclaimer()
+    {
+        drain();
+    }
+
+    // item was unlinked: guards taken from now on cannot reach it. It goes to
+    // the slot of the guard of the thread, which frees it on a later exit
+    void retire(Item item)
+    {
+        if (current.r == this)
+        {
+            push(slots[current.s], std::move(item));
+            return;
+        }
+        size_t i = enter();
+        push(slots[i], std::move(item));
+        exit(i);
+    }
+
+    // free every retired item; no guard may be held
+    void drain()
+    {
+        for (size_t i = 0; i < SLOTS; ++i)
+        {
+            for (auto &r : slots[i].limbo)
+            {
+                reclaim(r.second);
+            }
+            slots[i].limbo.clear();
+            slots[i].pending.store(0, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    static constexpr size_t SLOTS = 64;
+    static constexpr uint64_t FREE = 0; // a held slot has (epoch << 1) | 1
+
+    struct alignas(64) slot
+    {
+        std::atomic<uint64_t> state{FREE};
+        std::atomic<size_t> pending{0}; // size of limbo, for whoever helps free it
+        std::vector<std::pair<uint64_t, Item>> limbo; // oldest first
+    };
+
+    static inline thread_local held current;
+
+    std::function<void(Item &)> reclaim;
+    std::unique_ptr<slot[]> slots;
+    alignas(64) std::atomic<uint64_t> global{0};
+
+    // index of the slot taken
+    size_t enter()
+    {
+        static std::atomic<unsigned> next_hint{0};
+        thread_local unsigned hint = next_hint.fetch_add(1, std::memory_order_relaxed);
+        for (size_t i = hint % SLOTS, tries = 1;; i = (i + 1) % SLOTS, ++tries)
+        {
+            slot &s = slots[i];
+            uint64_t e = global.load();
+            uint64_t state = FREE;
+            if (s.state.load(std::memory_order_relaxed) == FREE && s.state.compare_exchange_strong(state, e << 1 | 1))
+            {
+                // an advance may have missed the slot while it was free
+                for (uint64_t now; (now = global.load()) != e; e = now)
+                {
+                    s.state.store(now << 1 | 1);
+                }
+                return i;
+            }
+            if (tries % SLOTS == 0)
+            {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    void exit(size_t i)
+    {
+        slot &s = slots[i];
+        if (!s.limbo.empty())
+        {
+            // done with whatever the guard reached, so it can let the epoch go
+            s.state.store(global.load() << 1 | 1);
+            advance();
+            collect(s);
+        }
+        s.state.store(FREE, std::memory_order_release);
+    }
+
+    void push(slot &s, Item &&item)
+    {
+        s.limbo.emplace_back(global.load(), std::move(item));
+        s.pending.store(s.limbo.size(), std::memory_order_relaxed);
+    }
+
+    // move the epoch on if every held slot has seen it, then free what it
+    // made free in the slots nobody holds
+    void advance()
+    {
+        uint64_t e = global.load();
+        for (size_t i = 0; i < SLOTS; ++i)
+        {
+            uint64_t state = slots[i].state.load();
+            if (state != FREE && state >> 1 != e)
+            {
+                return;
+            }
+        }
+        if (!global.compare_exchange_strong(e, e + 1))
+        {
+            return;
+        }
+        for (size_t i = 0; i < SLOTS; ++i)
+        {
+            slot &s = slots[i];
+            uint64_t state = FREE;
+            if (s.pending.load(std::memory_order_relaxed) > 0 && s.state.load(std::memory_order_relaxed) == FREE &&
+                s.state.compare_exchange_strong(state, (e + 1) << 1 | 1))
+            {
+                collect(s);
+                s.state.store(FREE, std::memory_order_release);
+            }
+        }
+    }
+
+    // free the items of s retired two epochs ago or earlier
+    void collect(slot &s)
+    {
+        uint64_t e = global.load();
+        size_t n = 0;
+        while (n < s.limbo.size() && s.limbo[n].first + 2 <= e)
+        {
+            reclaim(s.limbo[n].second);
+            ++n;
+        }
+        s.limbo.erase(s.limbo.begin(), s.limbo.begin() + n);
+        s.pending.store(s.limbo.size(), std::memory_order_relaxed);
+    }
+};
+
+#endif
@@ -0,0 +1,246 @@
+#ifndef __HOT_CACHE_HPP__
+#define __HOT_CACHE_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <cstdint>
+#include <cstring>
+
+// Key -> value cache for the hottest keys of a skewed workload, in front of
+// the tree. A key can only live in one bucket of WAYS slots; readers copy the
+// bucket under its seqlock and take no lock. Admission is TinyLFU: a
+// count-min sketch estimates how often keys were asked for lately, and a
+// missed key only displaces the least frequent key of its bucket if it was
+// asked for more often. The counters saturate at 15, as 4-bit ones would, so
+// the hottest keys only read theirs, and all are halved every AGING accesses
+// per cached key so old popularity fades.
+//
+// A writer bumps the bucket version of the key it changed after changing the
+// tree, so a value read from the tree is only admitted if no writer got to
+// its bucket since the miss.
+template <typename Key, typename T>
+class hot_cache
+{
+public:
+    hot_cache(size_t capacity)
+    {
+        size_t n = 1;
+        while (n * WAYS < capacity)
+        {
+            n <<= 1;
+        }
+        bucket_mask = n - 1;
+        buckets.reset(new bucket[n]);
+        size_t width = 64;
+        while (width < n * WAYS)
+        {
+            width <<= 1;
+        }
+        sketch_mask = width - 1;
+        sketch.reset(new std::atomic<uint8_t>[ROWS * width]());
+        aging_period = AGING * n * WAYS;
+    }
+
+    // the value of key if it is cached, and the stamp admit() needs after a
+    // miss; counts the access either way
+    bool find(Key key, T &val, uint64_t &stamp)
+    {
+        uint64_t h = mix(static_cast<uint64_t>(key));
+        touch(h);
+        bucket &b = buckets[h & bucket_mask];
+        while (true)
+        {
+            uint64_t version = b.version.load(std::memory_order_acquire);
+            if (version & 1)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            bool hit = false;
+            for (unsigned w = 0; w < WAYS; ++w)
+            {
+                if ((b.used >> w & 1) && b.keys[w] == key)
+                {
+                    val = b.vals[w];
+                    hit = true;
+                    break;
+                }
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (b.version.load(std::memory_order_relaxed) == version)
+            {
+                stamp = version;
+                return hit;
+            }
+        }
+    }
+
+    // the value of key read from the tree after find() missed with stamp;
+    // it takes a free slot or the slot of a less frequent key
+    void admit(Key key, const T &val, uint64_t stamp)
+    {
+        uint64_t h = mix(static_cast<uint64_t>(key));
+        bucket &b = buckets[h & bucket_mask];
+        uint64_t version = b.version.load(std::memory_order_relaxed);
+        if (version != stamp || !b.version.compare_exchange_strong(version, version + 1, std::memory_order_acquire))
+        {
+            return;
+        }
+        unsigned victim = WAYS;
+        if (b.used != (1u << WAYS) - 1)
+        {
+            victim = __builtin_ctz(~b.used);
+        }
+        else
+        {
+            uint32_t least = estimate(h);
+            for (unsigned w = 0; w < WAYS; ++w)
+            {
+                uint32_t f = estimate(mix(static_cast<uint64_t>(b.keys[w])));
+                if (f < least)
+                {
+                    least = f;
+                    victim = w;
+                }
+            }
+        }
+        if (victim < WAYS)
+        {
+            b.keys[victim] = key;
+            b.vals[victim] = val;
+            b.used |= 1u << victim;
+        }
+        b.version.store(version + 2, std::memory_order_release);
+    }
+
+    // key changed in the tree: drop it
+    void invalidate(Key key)
+    {
+        bucket &b = buckets[mix(static_cast<uint64_t>(key)) & bucket_mask];
+        uint64_t version = lock(b);
+        for (unsigned w = 0; w < WAYS; ++w)
+        {
+            if ((b.used >> w & 1) && b.keys[w] == key)
+            {
+                b.used &= ~(1u << w);
+            }
+        }
+        b.version.store(version + 2, std::memory_order_release);
+    }
+
+    // key got val in the tree; only for writers ordered by a lock of the key
+    void set(Key key, const T &val)
+    {
+        bucket &b = buckets[mix(static_cast<uint64_t>(key)) & bucket_mask];
+        uint64_t version = lock(b);
+        for (unsigned w = 0; w < WAYS; ++w)
+        {
+            if ((b.used >> w & 1) && b.keys[w] == key)
+            {
+                b.vals[w] = val;
+            }
+        }
+        b.version.store(version + 2, std::memory_order_release);
+    }
+
+private:
+    static constexpr unsigned WAYS = 4;
+    static constexpr unsigned ROWS = 4;
+    static constexpr uint8_t MAX_COUNT = 15;
+    static constexpr size_t AGING = 10;
+
+    struct alignas(64) bucket
+    {
+        std::atomic<uint64_t> version{0}; // odd while a writer is in
+        uint32_t used = 0;                // bit w set = slot w holds a key
+        Key keys[WAYS];
+        T vals[WAYS];
+    };
+
+    std::unique_ptr<bucket[]> buckets;
+    size_t bucket_mask;
+    std::unique_ptr<std::atomic<uint8_t>[]> sketch;
+    size_t sketch_mask;
+    size_t aging_period;
+    std::atomic<size_t> accesses{0};
+    std::atomic<bool> aging{false};
+
+    static uint64_t mix(uint64_t x)
+    {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdull;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ull;
+        x ^= x >> 33;
+        return x;
+    }
+
+    // counter of row r for the key hashed to h
+    std::atomic<uint8_t> &counter(uint64_t h, unsigned r)
+    {
+        return sketch[r * (sketch_mask + 1) + (mix(h + r) & sketch_mask)];
+    }
+
+    uint32_t estimate(uint64_t h)
+    {
+        uint32_t f = MAX_COUNT;
+        for (unsigned r = 0; r < ROWS; ++r)
+        {
+            f = std::min<uint32_t>(f, counter(h, r).load(std::memory_order_relaxed));
+        }
+        return f;
+    }
+
+    // count an access; increments may get lost between threads, which only
+    // blurs the estimate
+    void touch(uint64_t h)
+    {
+        for (unsigned r = 0; r < ROWS; ++r)
+        {
+            auto &c = counter(h, r);
+            uint8_t n = c.load(std::memory_order_relaxed);
+            if (n < MAX_COUNT)
+            {
+                c.store(n + 1, std::memory_order_relaxed);
+            }
+        }
+        // the shared access count is bumped once per batch of a thread
+        static thread_local uint32_t pending = 0;
+        if (++pending < 64)
+        {
+            return;
+        }
+        pending = 0;
+        if (accesses.fetch_add(64, std::memory_order_relaxed) + 64 >= aging_period && !aging.exchange(true))
+        {
+            for (size_t i = 0; i < ROWS * (sketch_mask + 1); ++i)
+            {
+                sketch[i].store(sketch[i].load(std::memory_order_relaxed) >> 1, std::memory_order_relaxed);
+            }
+            accesses.store(0, std::memory_order_relaxed);
+            aging.store(false);
+        }
+    }
+
+    uint64_t lock(bucket &b)
+    {
+        uint64_t version = b.version.load(std::memory_order_relaxed);
+        while (true)
+        {
+            if (version & 1)
+            {
+                std::this_thread::yield();
+                version = b.version.load(std::memory_order_relaxed);
+                continue;
+            }
+            if (b.version.compare_exchange_weak(version, version + 1, std::memory_order_acquire))
+            {
+                return version;
+            }
+        }
+    }
+};
+
+#endif
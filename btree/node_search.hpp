@@ -0,0 +1,116 @@
+#ifndef __NODE_SEARCH_HPP__
+#define __NODE_SEARCH_HPP__
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Search in the sorted key array of a page. The range is halved without
+// branches until it fits in a few cache lines, which are then compared
+// against the key a vector at a time and the matches counted. The kernel is
+// chosen at compile time from the key type and the instruction set the
+// build targets (-march=native); other key types use std::lower_bound.
+namespace node_search
+{
+// number of keys in keys[0, n) that are < key, or <= key when upper
+template <bool upper, typename Key>
+inline size_t count_window(const Key *keys, size_t n, Key key)
+{
+    size_t cnt = 0, i = 0;
+#if defined(__AVX512F__)
+    if constexpr (std::is_same<Key, uint32_t>::value)
+    {
+        __m512i k = _mm512_set1_epi32((int)key);
+        for (; i + 16 <= n; i += 16)
+        {
+            __m512i v = _mm512_loadu_si512(keys + i);
+            cnt += __builtin_popcount(upper ? _mm512_cmple_epu32_mask(v, k) : _mm512_cmplt_epu32_mask(v, k));
+        }
+    }
+    else if constexpr (std::is_same<Key, uint64_t>::value)
+    {
+        __m512i k = _mm512_set1_epi64((long long)key);
+        for (; i + 8 <= n; i += 8)
+        {
+            __m512i v = _mm512_loadu_si512(keys + i);
+            cnt += __builtin_popcount(upper ? _mm512_cmple_epu64_mask(v, k) : _mm512_cmplt_epu64_mask(v, k));
+        }
+    }
+#elif defined(__AVX2__)
+    // no unsigned compares: flip the sign bits and compare signed
+    if constexpr (std::is_same<Key, uint32_t>::value)
+    {
+        __m256i flip = _mm256_set1_epi32(INT32_MIN);
+        __m256i k = _mm256_xor_si256(_mm256_set1_epi32((int)key), flip);
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256i v = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i)), flip);
+            // upper: not v > key, lower: key > v
+            __m256i gt = upper ? _mm256_cmpgt_epi32(v, k) : _mm256_cmpgt_epi32(k, v);
+            int m = __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(gt)));
+            cnt += upper ? 8 - m : m;
+        }
+    }
+    else if constexpr (std::is_same<Key, uint64_t>::value)
+    {
+        __m256i flip = _mm256_set1_epi64x(INT64_MIN);
+        __m256i k = _mm256_xor_si256(_mm256_set1_epi64x((long long)key), flip);
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256i v = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i)), flip);
+            __m256i gt = upper ? _mm256_cmpgt_epi64(v, k) : _mm256_cmpgt_epi64(k, v);
+            int m = __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(gt)));
+            cnt += upper ? 4 - m : m;
+        }
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        cnt += upper ? keys[i] <= key : keys[i] < key;
+    }
+    return cnt;
+}
+
+template <bool upper, typename Key>
+inline size_t search(const Key *keys, size_t n, Key key)
+{
+    if constexpr (!std::is_same<Key, uint32_t>::value && !std::is_same<Key, uint64_t>::value)
+    {
+        return (upper ? std::upper_bound(keys, keys + n, key) : std::lower_bound(keys, keys + n, key)) - keys;
+    }
+    else
+    {
+        constexpr size_t WINDOW = 256 / sizeof(Key);
+        const Key *base = keys;
+        while (n > WINDOW)
+        {
+            size_t half = n / 2;
+            bool right = upper ? base[half - 1] <= key : base[half - 1] < key;
+            base += right ? half : 0;
+            n -= half;
+        }
+        return (base - keys) + count_window<upper>(base, n, key);
+    }
+}
+
+// index of the first key >= key in the sorted keys[0, n)
+template <typename Key>
+inline size_t lower_index(const Key *keys, size_t n, Key key)
+{
+    return search<false>(keys, n, key);
+}
+
+// index of the first key > key in the sorted keys[0, n)
+template <typename Key>
+inline size_t upper_index(const Key *keys, size_t n, Key key)
+{
+    return search<true>(keys, n, key);
+}
+} // namespace node_search
+
+#endif
@@ -0,0 +1,751 @@
+#ifndef __PAGE_STORE_HPP__
+#define __PAGE_STORE_HPP__
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "../common/tree_stats.hpp"
+#include "crc32.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Fixed-size pages kept in a few preallocated files instead of one file per page.
+// page p lives in stripe p % num_stripes at offset (p / num_stripes) * page_size.
+//
+// With shadow paging a page is instead written to a fresh slot each time,
+// laid out like pages above, and a page map tells which slot holds it. The
+// slots the last commit() refers to are never overwritten, so its image of
+// every page survives a crash; commit() switches to a newer image with one
+// write of the map.
+//
+// An image is described by a superblock: root, page count, free and leaf
+// bitmaps and, with shadow paging, the page map. It goes to path_super_0 and
+// path_super_1 in turn, so a torn write leaves the previous one intact.
+// open_image() restores the metadata only, pages are read when first needed.
+//
+// With mmap each file is mapped shared into an address range reserved up
+// front, so the mapping grows with the file without moving; reads and
+// writes become copies and page_addr() gives the page itself.
+class page_store
+{
+public:
+    static constexpr uint32_t INVALID_PAGE = UINT32_MAX;
+
+    // the files at path are kept for open_image() when reopen, emptied otherwise
+    page_store(const std::string &path, size_t page_size, bool reopen = false, size_t num_stripes = 4,
+               size_t extent_pages = 16384)
+        : page_sz(page_size), extent(extent_pages), super_file(path + "_super")
+    {
+        if (num_stripes == 0)
+        {
+            num_stripes = 1;
+        }
+        if (extent < num_stripes)
+        {
+            extent = num_stripes;
+        }
+        for (size_t i = 0; i < num_stripes; ++i)
+        {
+            std::string file_name = path + "_" + std::to_string(i);
+            int fd = open(file_name.c_str(), O_RDWR | O_CREAT | (reopen ? 0 : O_TRUNC), 0644);
+            if (fd < 0)
+            {
+                fprintf(stderr, "page_store: cannot open %s\n", file_name.c_str());
+                abort();
+            }
+            fds.push_back(fd);
+        }
+        if (!reopen)
+        {
+            drop_superblocks();
+        }
+    }
+
+    ~page_store()
+    {
+        for (char *base : bases)
+        {
+            munmap(base, MMAP_RESERVE);
+        }
+        if (slot_dir)
+        {
+            for (uint32_t i = 0; i < MAP_DIR_SIZE; ++i)
+            {
+                delete[] slot_dir[i].load(std::memory_order_relaxed);
+            }
+        }
+        for (auto fd : fds)
+        {
+            close(fd);
+        }
+    }
+
+    size_t page_size() const
+    {
+        return page_sz;
+    }
+
+    // count page reads and writes in stats from now on
+    void set_stats(tree_stats *s)
+    {
+        stats = s;
+    }
+
+    // write pages to fresh slots from now on; must be called before the
+    // first page is allocated or open_image()
+    void enable_shadow()
+    {
+        shadow = true;
+        slot_dir.reset(new std::atomic<std::atomic<uint32_t> *>[MAP_DIR_SIZE]());
+    }
+
+    // take over the image of the newest intact superblock: returns its root
+    // and calls set_leaf(id, leaf) for every page id below num_pages(), or
+    // returns INVALID_PAGE when there is none. Without shadow paging pages are
+    // overwritten in place from now on, so the superblock is dropped until
+    // the next final commit()
+    template <typename F>
+    uint32_t open_image(F &&set_leaf)
+    {
+        superblock h;
+        std::vector<uint64_t> body;
+        if (!read_superblock(h, body))
+        {
+            return INVALID_PAGE;
+        }
+        if (h.page_size != page_sz || (h.shadow != 0) != shadow)
+        {
+            fprintf(stderr, "page_store: the image has %u byte pages%s shadow paging\n", h.page_size,
+                    h.shadow ? " and" : ", no");
+            abort();
+        }
+        std::unique_lock lock(alloc_mutex);
+        size_t words = (h.num_pages + 63) >> 6;
+        next_page = h.num_pages;
+        used.assign(body.begin(), body.begin() + words);
+        free_hint = 0;
+        for (uint32_t id = 0; id < next_page; ++id)
+        {
+            set_leaf(id, (body[words + (id >> 6)] >> (id & 63) & 1) != 0);
+        }
+        commit_seq = h.seq;
+        if (shadow)
+        {
+            const uint32_t *map = reinterpret_cast<const uint32_t *>(&body[2 * words]);
+            for (uint32_t id = 0; id < next_page; ++id)
+            {
+                if (map[id] == INVALID_PAGE)
+                {
+                    continue;
+                }
+                map_page(id, map[id]);
+                next_slot = std::max(next_slot, map[id] + 1);
+            }
+            slot_used.assign((next_slot + 63) >> 6, 0);
+            for (uint32_t id = 0; id < next_page; ++id)
+            {
+                if (map[id] != INVALID_PAGE)
+                {
+                    slot_used[map[id] >> 6] |= 1ull << (map[id] & 63);
+                    ++used_slots;
+                }
+            }
+            grow(next_slot);
+        }
+        else
+        {
+            grow(next_page);
+            drop_superblocks();
+        }
+        return h.root;
+    }
+
+    bool shadowed() const
+    {
+        return shadow;
+    }
+
+    // serve pages from a mapping of the files from now on; must be called
+    // before the first page is allocated or open_image(), not with shadow paging
+    void enable_mmap()
+    {
+        for (size_t i = 0; i < fds.size(); ++i)
+        {
+            void *base = mmap(nullptr, MMAP_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (base == MAP_FAILED)
+            {
+                fprintf(stderr, "page_store: cannot reserve address space for the mapping\n");
+                abort();
+            }
+            bases.push_back(static_cast<char *>(base));
+        }
+    }
+
+    bool mapped() const
+    {
+        return !bases.empty();
+    }
+
+    // the mapped page id, stays valid until the store is destroyed
+    char *page_addr(uint32_t id) const
+    {
+        return bases[id % fds.size()] + slot_offset(id);
+    }
+
+    // tell the kernel whether the mapping is about to be read in order, so it
+    // reads ahead, or at random, so it reads only the pages touched
+    void advise(bool sequential)
+    {
+        std::unique_lock lock(alloc_mutex);
+        map_advice = sequential ? MADV_SEQUENTIAL : MADV_RANDOM;
+        for (char *base : bases)
+        {
+            if (mapped_len > 0)
+            {
+                madvise(base, mapped_len, map_advice);
+            }
+        }
+    }
+
+    // high-water mark, every id below it has been handed out at least once
+    uint32_t num_pages()
+    {
+        std::unique_lock lock(alloc_mutex);
+        return next_page;
+    }
+
+    uint32_t alloc_page()
+    {
+        std::unique_lock lock(alloc_mutex);
+        uint32_t id;
+        if (!find_free(id))
+        {
+            id = next_page++;
+            if (!shadow && next_page > capacity)
+            {
+                grow(next_page);
+            }
+            if ((id >> 6) >= used.size())
+            {
+                used.resize((id >> 6) + 1, 0);
+            }
+        }
+        used[id >> 6] |= 1ull << (id & 63);
+        return id;
+    }
+
+    void free_page(uint32_t id)
+    {
+        std::unique_lock lock(alloc_mutex);
+        used[id >> 6] &= ~(1ull << (id & 63));
+        if ((id >> 6) < free_hint)
+        {
+            free_hint = id >> 6;
+        }
+        if (shadow)
+        {
+            map_page(id, INVALID_PAGE);
+        }
+    }
+
+    bool is_allocated(uint32_t id)
+    {
+        std::unique_lock lock(alloc_mutex);
+        return (id >> 6) < used.size() && (used[id >> 6] >> (id & 63) & 1);
+    }
+
+    void read(uint32_t id, void *buf, size_t len)
+    {
+        if (stats != nullptr)
+        {
+            stats->add(tree_stats::PAGE_READS);
+            stats->add(tree_stats::BYTES_READ, len);
+        }
+        uint32_t slot = slot_of(id);
+        char *p = static_cast<char *>(buf);
+        if (slot == INVALID_PAGE)
+        {
+            // never written
+            memset(p, 0, len);
+            return;
+        }
+        if (mapped())
+        {
+            memcpy(p, page_addr(slot), len);
+            return;
+        }
+        int fd = fds[slot % fds.size()];
+        off_t off = slot_offset(slot);
+        while (len > 0)
+        {
+            ssize_t n = pread(fd, p, len, off);
+            if (n <= 0)
+            {
+                fprintf(stderr, "page_store: I/O error in read\n");
+                abort();
+            }
+            p += n;
+            off += n;
+            len -= n;
+        }
+    }
+
+    void write(uint32_t id, const void *buf, size_t len)
+    {
+        if (stats != nullptr)
+        {
+            stats->add(tree_stats::PAGE_WRITES);
+            stats->add(tree_stats::BYTES_WRITTEN, len);
+        }
+        uint32_t slot = shadow ? take_slot() : id;
+        const char *p = static_cast<const char *>(buf);
+        if (mapped())
+        {
+            memcpy(page_addr(slot), p, len);
+            return;
+        }
+        int fd = fds[slot % fds.size()];
+        off_t off = slot_offset(slot);
+        while (len > 0)
+        {
+            ssize_t n = pwrite(fd, p, len, off);
+            if (n <= 0)
+            {
+                fprintf(stderr, "page_store: I/O error in write\n");
+                abort();
+            }
+            p += n;
+            off += n;
+            len -= n;
+        }
+        if (shadow)
+        {
+            // readers see the new slot only once it is written
+            std::unique_lock lock(alloc_mutex);
+            map_page(id, slot);
+        }
+    }
+
+    // with shadow paging, move page id to a fresh slot for a caller that
+    // writes it itself at fd_of(id) and offset(id); the page must not be read
+    // from the store or committed before that write completes
+    void relocate(uint32_t id)
+    {
+        if (shadow)
+        {
+            uint32_t slot = take_slot();
+            std::unique_lock lock(alloc_mutex);
+            map_page(id, slot);
+        }
+    }
+
+    // hint the kernel to start reading page id in the background
+    void prefetch(uint32_t id)
+    {
+        uint32_t slot = slot_of(id);
+        if (slot == INVALID_PAGE)
+        {
+            return;
+        }
+        if (mapped())
+        {
+            // madvise wants whole pages of memory
+            uintptr_t from = reinterpret_cast<uintptr_t>(page_addr(slot)) & ~(uintptr_t)(MEM_PAGE - 1);
+            uintptr_t to = reinterpret_cast<uintptr_t>(page_addr(slot)) + page_sz;
+            madvise(reinterpret_cast<void *>(from), to - from, MADV_WILLNEED);
+            return;
+        }
+        posix_fadvise(fds[slot % fds.size()], slot_offset(slot), page_sz, POSIX_FADV_WILLNEED);
+    }
+
+    void sync()
+    {
+        for (char *base : bases)
+        {
+            msync(base, mapped_len, MS_SYNC);
+        }
+        for (auto fd : fds)
+        {
+            fdatasync(fd);
+        }
+    }
+
+    // make every page written so far durable. With shadow paging also make
+    // it the image a crash goes back to: the superblock goes to the older of
+    // the two files, and the slots only the previous image used are reused
+    // from then on. Pages written concurrently may or may not be part of the
+    // image. Without shadow paging only a final commit, after which no page
+    // is written, leaves an image. is_leaf(id) tells the type of a page
+    template <typename F>
+    void commit(uint32_t root, F &&is_leaf, bool final = false)
+    {
+        if (!shadow && !final)
+        {
+            sync();
+            return;
+        }
+        std::unique_lock commit_lock(commit_mutex);
+        std::vector<uint64_t> body;
+        std::vector<uint32_t> released;
+        uint32_t n;
+        {
+            std::unique_lock lock(alloc_mutex);
+            n = next_page;
+            size_t words = (n + 63) >> 6;
+            body.assign(used.begin(), used.begin() + words);
+            body.resize(2 * words + (shadow ? (n + 1) / 2 : 0), 0);
+            for (uint32_t id = 0; id < n; ++id)
+            {
+                if (is_leaf(id))
+                {
+                    body[words + (id >> 6)] |= 1ull << (id & 63);
+                }
+            }
+            if (shadow)
+            {
+                uint32_t *map = reinterpret_cast<uint32_t *>(&body[2 * words]);
+                for (uint32_t id = 0; id < n; ++id)
+                {
+                    map[id] = slot_of(id);
+                }
+            }
+            released.swap(superseded);
+        }
+        sync();
+        superblock h;
+        h.magic = SUPER_MAGIC;
+        h.seq = ++commit_seq;
+        h.root = root;
+        h.num_pages = n;
+        h.page_size = page_sz;
+        h.shadow = shadow;
+        h.crc = crc32(body.data(), body.size() * sizeof(uint64_t), crc32(&h.seq, sizeof(h) - 8));
+        write_superblock(super_file + "_" + std::to_string(h.seq & 1), h, body);
+        if (!shadow)
+        {
+            return;
+        }
+        std::unique_lock lock(alloc_mutex);
+        for (uint32_t slot : released)
+        {
+            slot_used[slot >> 6] &= ~(1ull << (slot & 63));
+            --used_slots;
+        }
+    }
+
+    // slots given up since the last commit
+    size_t superseded_pages()
+    {
+        std::unique_lock lock(alloc_mutex);
+        return superseded.size();
+    }
+
+    // where page id lives on disk, for callers doing their own I/O
+    int fd_of(uint32_t id) const
+    {
+        return fds[slot_of(id) % fds.size()];
+    }
+
+    off_t offset(uint32_t id) const
+    {
+        return slot_offset(slot_of(id));
+    }
+
+private:
+    size_t page_sz;
+    size_t extent;
+    std::vector<int> fds;
+    tree_stats *stats = nullptr;
+    std::mutex alloc_mutex;
+    std::vector<uint64_t> used; // free-page bitmap, bit set = allocated
+    size_t free_hint = 0;       // no free bit below this word
+    uint32_t next_page = 0;
+    uint32_t capacity = 0;      // pages preallocated over all stripes
+
+    // mmap: address range reserved per file, of which mapped_len bytes map it
+    static constexpr size_t MMAP_RESERVE = 1ull << 40;
+    static constexpr size_t MEM_PAGE = 4096;
+    std::vector<char *> bases;
+    size_t mapped_len = 0;
+    int map_advice = MADV_RANDOM;
+
+    // followed by the free and leaf bitmaps of num_pages bits each and, with
+    // shadow paging, the num_pages slots of the page map
+    static constexpr uint32_t SUPER_MAGIC = 0x53475042; // "BPGS"
+    struct superblock
+    {
+        uint32_t magic;
+        uint32_t crc; // over the rest of the superblock, the bitmaps and the map
+        uint64_t seq;
+        uint32_t root;
+        uint32_t num_pages;
+        uint32_t page_size;
+        uint32_t shadow;
+    };
+    std::string super_file;
+    std::mutex commit_mutex;
+    uint64_t commit_seq = 0;
+
+    // shadow paging: page id -> slot in a directory of segments allocated on
+    // first use, so lookups take no lock
+    static constexpr uint32_t MAP_SEG_BITS = 16;
+    static constexpr uint32_t MAP_SEG_SIZE = 1u << MAP_SEG_BITS;
+    static constexpr uint32_t MAP_DIR_SIZE = 1u << (32 - MAP_SEG_BITS);
+
+    bool shadow = false;
+    std::unique_ptr<std::atomic<std::atomic<uint32_t> *>[]> slot_dir;
+    std::vector<uint64_t> slot_used;  // bit set = slot held by the map or the last commit
+    uint32_t next_slot = 0;           // high-water mark of slots
+    uint32_t slot_cursor = 0;         // slots are handed out sweeping forward from here
+    uint32_t used_slots = 0;
+    std::vector<uint32_t> superseded; // slots replaced since the last commit, still in its image
+
+    uint32_t slot_of(uint32_t id) const
+    {
+        if (!shadow)
+        {
+            return id;
+        }
+        std::atomic<uint32_t> *seg = slot_dir[id >> MAP_SEG_BITS].load(std::memory_order_acquire);
+        return seg == nullptr ? INVALID_PAGE : seg[id & (MAP_SEG_SIZE - 1)].load(std::memory_order_acquire);
+    }
+
+    off_t slot_offset(uint32_t slot) const
+    {
+        return (off_t)(slot / fds.size()) * page_sz;
+    }
+
+    // must hold alloc_mutex
+    void map_page(uint32_t id, uint32_t slot)
+    {
+        auto &entry = slot_dir[id >> MAP_SEG_BITS];
+        std::atomic<uint32_t> *seg = entry.load(std::memory_order_relaxed);
+        if (seg == nullptr)
+        {
+            seg = new std::atomic<uint32_t>[MAP_SEG_SIZE];
+            for (uint32_t i = 0; i < MAP_SEG_SIZE; ++i)
+            {
+                seg[i].store(INVALID_PAGE, std::memory_order_relaxed);
+            }
+            entry.store(seg, std::memory_order_release);
+        }
+        uint32_t old = seg[id & (MAP_SEG_SIZE - 1)].exchange(slot, std::memory_order_acq_rel);
+        if (old != INVALID_PAGE)
+        {
+            superseded.push_back(old);
+        }
+    }
+
+    // a free slot, sweeping forward so consecutive writes land next to each
+    // other; the sweep starts over from the front once a quarter of the slots
+    // are free, before that the files grow
+    uint32_t take_slot()
+    {
+        std::unique_lock lock(alloc_mutex);
+        uint32_t slot;
+        if (!sweep(slot))
+        {
+            if (next_slot - used_slots > next_slot / 4)
+            {
+                slot_cursor = 0;
+            }
+            if (!sweep(slot))
+            {
+                slot = next_slot++;
+                if (next_slot > capacity)
+                {
+                    grow(next_slot);
+                }
+                if ((slot >> 6) >= slot_used.size())
+                {
+                    slot_used.resize((slot >> 6) + 1, 0);
+                }
+            }
+        }
+        slot_used[slot >> 6] |= 1ull << (slot & 63);
+        ++used_slots;
+        slot_cursor = slot + 1;
+        return slot;
+    }
+
+    // must hold alloc_mutex
+    bool sweep(uint32_t &slot)
+    {
+        while (slot_cursor < next_slot)
+        {
+            uint64_t w = ~slot_used[slot_cursor >> 6] & (~0ull << (slot_cursor & 63));
+            if (w == 0)
+            {
+                slot_cursor = ((slot_cursor >> 6) + 1) << 6;
+                continue;
+            }
+            uint32_t cand = ((slot_cursor >> 6) << 6) + __builtin_ctzll(w);
+            if (cand >= next_slot)
+            {
+                break;
+            }
+            slot = cand;
+            return true;
+        }
+        slot_cursor = next_slot;
+        return false;
+    }
+
+    void write_superblock(const std::string &file_name, const superblock &h, const std::vector<uint64_t> &body)
+    {
+        int fd = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            fprintf(stderr, "page_store: cannot open %s\n", file_name.c_str());
+            abort();
+        }
+        std::vector<char> buf(sizeof(h) + body.size() * sizeof(uint64_t));
+        memcpy(buf.data(), &h, sizeof(h));
+        if (!body.empty())
+        {
+            memcpy(buf.data() + sizeof(h), body.data(), body.size() * sizeof(uint64_t));
+        }
+        const char *p = buf.data();
+        size_t len = buf.size();
+        off_t off = 0;
+        while (len > 0)
+        {
+            ssize_t n = pwrite(fd, p, len, off);
+            if (n <= 0)
+            {
+                fprintf(stderr, "page_store: I/O error in write\n");
+                abort();
+            }
+            p += n;
+            off += n;
+            len -= n;
+        }
+        fdatasync(fd);
+        close(fd);
+    }
+
+    // the intact superblock with the highest seq
+    bool read_superblock(superblock &h, std::vector<uint64_t> &body)
+    {
+        bool found = false;
+        for (int i = 0; i < 2; ++i)
+        {
+            int fd = open((super_file + "_" + std::to_string(i)).c_str(), O_RDONLY);
+            if (fd < 0)
+            {
+                continue;
+            }
+            off_t len = lseek(fd, 0, SEEK_END);
+            std::vector<char> buf(len);
+            bool ok = len >= (off_t)sizeof(superblock) && pread(fd, buf.data(), len, 0) == (ssize_t)len;
+            close(fd);
+            if (!ok)
+            {
+                continue;
+            }
+            superblock cand;
+            memcpy(&cand, buf.data(), sizeof(cand));
+            if (cand.magic != SUPER_MAGIC)
+            {
+                continue;
+            }
+            size_t words = (cand.num_pages + 63) >> 6;
+            size_t body_len = (2 * words + (cand.shadow ? (cand.num_pages + 1) / 2 : 0)) * sizeof(uint64_t);
+            if ((size_t)len != sizeof(cand) + body_len ||
+                crc32(buf.data() + sizeof(cand), body_len, crc32(&cand.seq, sizeof(cand) - 8)) != cand.crc ||
+                (found && cand.seq < h.seq))
+            {
+                continue;
+            }
+            h = cand;
+            body.resize(body_len / sizeof(uint64_t));
+            memcpy(body.data(), buf.data() + sizeof(cand), body_len);
+            found = true;
+        }
+        return found;
+    }
+
+    void drop_superblocks()
+    {
+        unlink((super_file + "_0").c_str());
+        unlink((super_file + "_1").c_str());
+    }
+
+    bool find_free(uint32_t &id)
+    {
+        size_t limit = (next_page + 63) >> 6;
+        for (; free_hint < limit; ++free_hint)
+        {
+            uint64_t w = ~used[free_hint];
+            if (w == 0)
+            {
+                continue;
+            }
+            uint32_t cand = (free_hint << 6) + __builtin_ctzll(w);
+            if (cand >= next_page)
+            {
+                break;
+            }
+            id = cand;
+            return true;
+        }
+        return false;
+    }
+
+    // must hold alloc_mutex
+    void grow(uint32_t min_pages)
+    {
+        while (capacity < min_pages)
+        {
+            capacity += extent;
+        }
+        off_t len = (off_t)((capacity + fds.size() - 1) / fds.size()) * page_sz;
+        for (auto fd : fds)
+        {
+            if (posix_fallocate(fd, 0, len) != 0 && ftruncate(fd, len) != 0)
+            {
+                fprintf(stderr, "page_store: cannot grow page file\n");
+                abort();
+            }
+        }
+        if (mapped() && (size_t)len > mapped_len)
+        {
+            map_files(len);
+        }
+    }
+
+    // must hold alloc_mutex; extend the mapping of every file to len bytes
+    void map_files(size_t len)
+    {
+        len = (len + MEM_PAGE - 1) & ~(MEM_PAGE - 1);
+        if (len > MMAP_RESERVE)
+        {
+            fprintf(stderr, "page_store: page file too large to map\n");
+            abort();
+        }
+        for (size_t i = 0; i < fds.size(); ++i)
+        {
+            void *p = mmap(bases[i] + mapped_len, len - mapped_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                           fds[i], mapped_len);
+            if (p == MAP_FAILED)
+            {
+                fprintf(stderr, "page_store: cannot map page file\n");
+                abort();
+            }
+            madvise(p, len - mapped_len, map_advice);
+        }
+        mapped_len = len;
+    }
+};
+
+#endif
@@ -0,0 +1,187 @@
+#ifndef __PAGE_TABLE_HPP__
+#define __PAGE_TABLE_HPP__
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <memory>
+
+// Exclusive/shared lock in one word: the writer bit, a bit telling that
+// someone sleeps on the word, a bit holding new shared holders back while a
+// writer waits for the current ones, and the number of shared holders.
+// Waiters spin briefly and then sleep on a futex, as a holder may be
+// waiting for I/O.
+class page_latch
+{
+public:
+    void lock()
+    {
+        for (unsigned spins = 0;; ++spins)
+        {
+            uint32_t c = word.load(std::memory_order_relaxed);
+            if ((c & ~(WAITERS | PENDING)) == 0)
+            {
+                if (word.compare_exchange_weak(c, (c & WAITERS) | WRITER, std::memory_order_acquire))
+                {
+                    return;
+                }
+                continue;
+            }
+            if (!(c & PENDING))
+            {
+                word.compare_exchange_weak(c, c | PENDING, std::memory_order_relaxed);
+                continue;
+            }
+            wait(c, spins);
+        }
+    }
+
+    void unlock()
+    {
+        if (word.fetch_and(~(WRITER | WAITERS), std::memory_order_release) & WAITERS)
+        {
+            wake();
+        }
+    }
+
+    void lock_shared()
+    {
+        for (unsigned spins = 0;; ++spins)
+        {
+            uint32_t c = word.load(std::memory_order_relaxed);
+            if (!(c & (WRITER | PENDING)))
+            {
+                if (word.compare_exchange_weak(c, c + 1, std::memory_order_acquire))
+                {
+                    return;
+                }
+                continue;
+            }
+            wait(c, spins);
+        }
+    }
+
+    void unlock_shared()
+    {
+        uint32_t c = word.fetch_sub(1, std::memory_order_release);
+        if ((c & ~(WAITERS | PENDING)) == 1 && (c & WAITERS))
+        {
+            word.fetch_and(~WAITERS, std::memory_order_relaxed);
+            wake();
+        }
+    }
+
+private:
+    static constexpr uint32_t WRITER = 1u << 31;
+    static constexpr uint32_t WAITERS = 1u << 30;
+    static constexpr uint32_t PENDING = 1u << 29;
+    static constexpr unsigned SPINS = 64;
+
+    std::atomic<uint32_t> word{0};
+
+    // the word was seen as c, held in a way that blocks us
+    void wait(uint32_t c, unsigned spins)
+    {
+        if (spins < SPINS)
+        {
+            __builtin_ia32_pause();
+            return;
+        }
+        if (!(c & WAITERS) && !word.compare_exchange_weak(c, c | WAITERS, std::memory_order_relaxed))
+        {
+            return;
+        }
+        // returns at once if the word changed since
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT_PRIVATE, c | WAITERS, nullptr, nullptr, 0);
+    }
+
+    void wake()
+    {
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+    }
+};
+
+// What the btree keeps per page, one cache line each.
+template <typename Frame, typename Delta>
+struct alignas(64) page_desc
+{
+    std::atomic<uint64_t> version{0}; // seqlock for optimistic readers, odd while the page is written
+    page_latch latch;                 // held while the page image is copied in or out
+    page_latch lock;                  // held by a writer across its whole change of the page
+    std::atomic<bool> leaf{false};
+    std::atomic<Frame *> frame{nullptr}; // in-memory image of the page, if it has one
+    std::atomic<Delta *> deltas{nullptr}; // changes not yet folded into the page, newest first
+    // kept by the holder of lock: recent inserts into the last tenth of the
+    // page, and inserts in a row past its last item
+    uint16_t tail_inserts = 0;
+    uint16_t ascending = 0;
+};
+
+// Page id -> descriptor. A fixed directory of segments of 1 << SEG_BITS
+// descriptors allocated on first use, so the table grows without moving a
+// descriptor and lookups take no lock. Owns the frames of its descriptors.
+template <typename Frame, typename Delta = void>
+class page_table
+{
+public:
+    page_table() : dir(new std::atomic<page_desc<Frame, Delta> *>[DIR_SIZE]())
+    {
+        get(0);
+    }
+
+    ~page_table()
+    {
+        for (uint32_t i = 0; i < DIR_SIZE; ++i)
+        {
+            page_desc<Frame, Delta> *seg = dir[i].load(std::memory_order_relaxed);
+            if (seg == nullptr)
+            {
+                continue;
+            }
+            for (uint32_t j = 0; j < SEG_SIZE; ++j)
+            {
+                delete seg[j].frame.load(std::memory_order_relaxed);
+            }
+            delete[] seg;
+        }
+    }
+
+    // descriptor of a page id handed out by get()
+    page_desc<Frame, Delta> &operator[](uint32_t id)
+    {
+        return dir[id >> SEG_BITS].load(std::memory_order_acquire)[id & (SEG_SIZE - 1)];
+    }
+
+    // descriptor of id, allocating its segment if needed
+    page_desc<Frame, Delta> &get(uint32_t id)
+    {
+        auto &slot = dir[id >> SEG_BITS];
+        page_desc<Frame, Delta> *seg = slot.load(std::memory_order_acquire);
+        if (seg == nullptr)
+        {
+            page_desc<Frame, Delta> *fresh = new page_desc<Frame, Delta>[SEG_SIZE];
+            if (slot.compare_exchange_strong(seg, fresh, std::memory_order_acq_rel))
+            {
+                seg = fresh;
+            }
+            else
+            {
+                delete[] fresh;
+            }
+        }
+        return seg[id & (SEG_SIZE - 1)];
+    }
+
+private:
+    static constexpr uint32_t SEG_BITS = 14;
+    static constexpr uint32_t SEG_SIZE = 1u << SEG_BITS;
+    static constexpr uint32_t DIR_SIZE = 1u << (32 - SEG_BITS);
+
+    std::unique_ptr<std::atomic<page_desc<Frame, Delta> *>[]> dir;
+};
+
+#endif
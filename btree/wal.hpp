@@ -0,0 +1,204 @@
+#ifndef __WAL_HPP__
+#define __WAL_HPP__
+
+#include "crc32.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Redo log of logical operations. Records are appended to a memory buffer;
+// commit() makes them durable, and whoever finds no flush running writes and
+// syncs the buffer on behalf of every thread waiting at that moment.
+// After a checkpoint has made the pages durable the log starts over.
+class wal
+{
+public:
+    enum op_type : uint8_t
+    {
+        OP_INSERT = 1,
+        OP_UPDATE = 2,
+        OP_REMOVE = 3,
+    };
+
+    // the records already at path are kept for replay() when keep
+    wal(const std::string &path, bool keep = false)
+    {
+        fd = open(path.c_str(), O_RDWR | O_CREAT | (keep ? 0 : O_TRUNC), 0644);
+        if (fd < 0)
+        {
+            fprintf(stderr, "wal: cannot open %s\n", path.c_str());
+            abort();
+        }
+    }
+
+    ~wal()
+    {
+        commit(next_lsn);
+        close(fd);
+    }
+
+    // lsn of the record: the log position just past it
+    uint64_t append(op_type type, const void *key, size_t key_sz, const void *val, size_t val_sz)
+    {
+        header h;
+        memset(&h, 0, sizeof(h));
+        h.type = type;
+        h.key_sz = key_sz;
+        h.val_sz = val_sz;
+        h.crc = checksum(crc32(&h.type, sizeof(h) - sizeof(h.crc), 0), key, key_sz, val, val_sz);
+        std::unique_lock lock(mutex);
+        size_t n = buf.size();
+        buf.resize(n + sizeof(h) + key_sz + val_sz);
+        memcpy(&buf[n], &h, sizeof(h));
+        memcpy(&buf[n + sizeof(h)], key, key_sz);
+        if (val_sz > 0)
+        { // a remove has no value, and val may be null
+            memcpy(&buf[n + sizeof(h) + key_sz], val, val_sz);
+        }
+        next_lsn += sizeof(h) + key_sz + val_sz;
+        return next_lsn;
+    }
+
+    // wait until everything up to lsn is on disk
+    void commit(uint64_t lsn)
+    {
+        std::unique_lock lock(mutex);
+        while (durable_lsn < lsn)
+        {
+            if (flushing)
+            {
+                flushed.wait(lock);
+                continue;
+            }
+            flushing = true;
+            uint64_t upto = next_lsn;
+            spare.swap(buf);
+            lock.unlock();
+            write_all(spare.data(), spare.size());
+            fdatasync(fd);
+            spare.clear();
+            lock.lock();
+            durable_lsn = upto;
+            flushing = false;
+            ++nsyncs;
+            flushed.notify_all();
+        }
+    }
+
+    uint64_t end()
+    {
+        std::unique_lock lock(mutex);
+        return next_lsn;
+    }
+
+    // bytes in the log since the last checkpoint
+    uint64_t size()
+    {
+        std::unique_lock lock(mutex);
+        return next_lsn - base_lsn;
+    }
+
+    // the pages reflect every record, drop them; no append may run concurrently
+    void reset()
+    {
+        commit(end());
+        std::unique_lock lock(mutex);
+        if (ftruncate(fd, 0) != 0)
+        {
+            fprintf(stderr, "wal: I/O error in truncate\n");
+            abort();
+        }
+        fdatasync(fd);
+        file_off = 0;
+        base_lsn = next_lsn;
+    }
+
+    // feed every intact record of the log to fn(type, key, key_sz, val, val_sz),
+    // stopping at the first torn one
+    template <typename F>
+    size_t replay(F &&fn)
+    {
+        off_t len = lseek(fd, 0, SEEK_END);
+        std::vector<char> log(len);
+        if (len > 0 && pread(fd, log.data(), len, 0) != (ssize_t)len)
+        {
+            fprintf(stderr, "wal: I/O error in read\n");
+            abort();
+        }
+        size_t pos = 0, cnt = 0;
+        while (pos + sizeof(header) <= log.size())
+        {
+            header h;
+            memcpy(&h, &log[pos], sizeof(h));
+            const char *key = &log[pos + sizeof(h)];
+            if (pos + sizeof(h) + h.key_sz + h.val_sz > log.size() ||
+                checksum(crc32(&h.type, sizeof(h) - sizeof(h.crc), 0), key, h.key_sz, key + h.key_sz, h.val_sz) != h.crc)
+            {
+                break;
+            }
+            fn((op_type)h.type, key, (size_t)h.key_sz, key + h.key_sz, (size_t)h.val_sz);
+            pos += sizeof(h) + h.key_sz + h.val_sz;
+            ++cnt;
+        }
+        return cnt;
+    }
+
+    uint64_t syncs()
+    {
+        std::unique_lock lock(mutex);
+        return nsyncs;
+    }
+
+private:
+    struct header
+    {
+        uint32_t crc; // over the rest of the header, key and value
+        uint8_t type;
+        uint8_t pad;
+        uint16_t key_sz;
+        uint32_t val_sz;
+    };
+
+    int fd;
+    off_t file_off = 0;
+    std::mutex mutex;
+    std::condition_variable flushed;
+    std::vector<char> buf, spare; // records not yet written, and the ones being written
+    uint64_t next_lsn = 0;
+    uint64_t durable_lsn = 0;
+    uint64_t base_lsn = 0; // lsn of the last checkpoint
+    bool flushing = false;
+    uint64_t nsyncs = 0;
+
+    void write_all(const char *p, size_t len)
+    {
+        while (len > 0)
+        {
+            ssize_t n = pwrite(fd, p, len, file_off);
+            if (n <= 0)
+            {
+                fprintf(stderr, "wal: I/O error in write\n");
+                abort();
+            }
+            p += n;
+            file_off += n;
+            len -= n;
+        }
+    }
+
+    static uint32_t checksum(uint32_t crc, const void *key, size_t key_sz, const void *val, size_t val_sz)
+    {
+        return crc32(val, val_sz, crc32(key, key_sz, crc));
+    }
+};
+
+#endif
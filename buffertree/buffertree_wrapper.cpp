@@ -1,26 +1,35 @@
 #include "buffertree_wrapper.hpp"
 
-extern "C" tree_api* create_tree(const tree_options_t& opt)
+// page size, one of 512, 4096, 8192, 16384; not part of tree_options_t
+static size_t buffertree_page_bytes()
+{
+    if (const char *s = getenv("BUFFERTREE_PAGE_BYTES"))
+        return atol(s);
+    return 4096;
+}
+
+template <size_t PageBytes>
+static tree_api* create_buffertree(const tree_options_t& opt)
 {
     if (opt.key_size == 4)
     {
         if (opt.value_size == 4)
-            return new buffertree_wrapper<uint32_t, uint32_t>();
+            return new buffertree_wrapper<uint32_t, uint32_t, PageBytes>();
         else if (opt.value_size == 8)
-            return new buffertree_wrapper<uint32_t, uint64_t>();
+            return new buffertree_wrapper<uint32_t, uint64_t, PageBytes>();
         else if (opt.value_size > 8)
-            return new buffertree_wrapper<uint32_t, std::string>();
+            return new buffertree_wrapper<uint32_t, std::string, PageBytes>();
         else
             return nullptr;// ERROR
     }
     else if (opt.key_size == 8)
     {
         if (opt.value_size == 4)
-            return new buffertree_wrapper<uint64_t, uint32_t>();
+            return new buffertree_wrapper<uint64_t, uint32_t, PageBytes>();
         else if (opt.value_size == 8)
-            return new buffertree_wrapper<uint64_t, uint64_t>();
+            return new buffertree_wrapper<uint64_t, uint64_t, PageBytes>();
         else if (opt.value_size > 8)
-            return new buffertree_wrapper<uint64_t, std::string>();
+            return new buffertree_wrapper<uint64_t, std::string, PageBytes>();
         else
             return nullptr;// ERROR
 
@@ -28,15 +37,35 @@ extern "C" tree_api* create_tree(const tree_options_t& opt)
     else if (opt.key_size > 8)
     {
         //if (opt.value_size == 4)
-        //    return new buffertree_wrapper<std::string, uint32_t>();
+        //    return new buffertree_wrapper<std::string, uint32_t, PageBytes>();
         //else if (opt.value_size == 8)
-        //    return new buffertree_wrapper<std::string, uint64_t>();
+        //    return new buffertree_wrapper<std::string, uint64_t, PageBytes>();
         //else if (opt.value_size > 8)
-        //    return new buffertree_wrapper<std::string, std::string>();
+        //    return new buffertree_wrapper<std::string, std::string, PageBytes>();
         //else
         //    return nullptr ;// ERROR
 
     }
     else
         return nullptr; // ERROR!
-}
\ No newline at end of file
+}
+
+extern "C" tree_api* create_tree(const tree_options_t& opt)
+{
+    // page buffers in 2 MB huge pages, for the whole process
+    if (const char *s = getenv("BUFFERTREE_HUGE_PAGES"))
+        page_alloc::use_huge_pages(atoi(s) != 0);
+    switch (buffertree_page_bytes())
+    {
+    case 512:
+        return create_buffertree<512>(opt);
+    case 4096:
+        return create_buffertree<4096>(opt);
+    case 8192:
+        return create_buffertree<8192>(opt);
+    case 16384:
+        return create_buffertree<16384>(opt);
+    default:
+        return nullptr; // ERROR
+    }
+}
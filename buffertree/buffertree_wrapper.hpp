@@ -2,6 +2,8 @@
 #define __buffertree_wrapper_HPP__
 
 #include "tree_api.hpp"
+#include "../common/tree_stats.hpp"
+#include "../common/page_alloc.hpp"
 
 #include <mutex>
 #include <shared_mutex>
@@ -13,7 +15,7 @@
 #include <list>
 #include <limits>
 
-template <typename Key, typename T>
+template <typename Key, typename T, size_t PageBytes = 4096>
 class buffertree_wrapper : public tree_api
 {
 public:
@@ -26,35 +28,42 @@ public:
     virtual bool remove(const char *key, size_t key_sz) override;
     virtual int scan(const char *key, size_t key_sz, int scan_sz, char *&values_out) override;
 
-    struct btree_node
+    // each struct occupies exactly one aligned page of PageBytes, allocated
+    // from page_alloc
+    struct alignas(PageBytes) btree_node : slab_allocated<PageBytes>
     {
-        Key key[4096 / 2 / (sizeof(Key) + sizeof(uint32_t)) - 1];
-        uint32_t nxt[4096 / 2 / (sizeof(Key) + sizeof(uint32_t)) - 1];
+        Key key[PageBytes / 2 / (sizeof(Key) + sizeof(uint32_t)) - 1];
+        uint32_t nxt[PageBytes / 2 / (sizeof(Key) + sizeof(uint32_t)) - 1];
         uint32_t num_item;
         uint32_t num_buf;
-        Key buf_key[4096 / 2 / (sizeof(Key) + sizeof(T)) - 1];
-        T buf_val[4096 / 2 / (sizeof(Key) + sizeof(T)) - 1];
-        char padding[8];
+        Key buf_key[PageBytes / 2 / (sizeof(Key) + sizeof(T)) - 1];
+        T buf_val[PageBytes / 2 / (sizeof(Key) + sizeof(T)) - 1];
     };
-    struct btree_data
+    struct alignas(PageBytes) btree_data : slab_allocated<PageBytes>
     {
-        Key key[4096 / (sizeof(Key) + sizeof(T)) - 1];
-        T val[4096 / (sizeof(Key) + sizeof(T)) - 1];
+        Key key[PageBytes / (sizeof(Key) + sizeof(T)) - 1];
+        T val[PageBytes / (sizeof(Key) + sizeof(T)) - 1];
         uint32_t num_item;
-        char padding[4];
     };
+    static_assert(PageBytes >= 512 && (PageBytes & (PageBytes - 1)) == 0, "page size must be a power of two of at least 512");
+    static_assert(sizeof(btree_node) == PageBytes, "btree_node must fill exactly one page");
+    static_assert(sizeof(btree_data) == PageBytes, "btree_data must fill exactly one page");
     void spill(uint32_t cur_id, btree_node *pnode);
 
+    // page I/O, splits, spills and operation latencies so far
+    tree_stats::snapshot stats();
+
 private:
     // key: 1   50  100     200     x
     // nxt: <1  <50 <100    <200    >=200
     // num_item at least 2 for a btree_node
 
     std::shared_mutex mutex_;
-    uint32_t node_cap = 4096 / 2 / (sizeof(Key) + sizeof(uint32_t)) - 1;
-    uint32_t node_buf_cap = 4096 / 2 / (sizeof(Key) + sizeof(uint32_t)) - 1;
-    uint32_t data_cap = 4096 / (sizeof(Key) + sizeof(T)) - 1;
+    uint32_t node_cap = PageBytes / 2 / (sizeof(Key) + sizeof(uint32_t)) - 1;
+    uint32_t node_buf_cap = PageBytes / 2 / (sizeof(Key) + sizeof(T)) - 1;
+    uint32_t data_cap = PageBytes / (sizeof(Key) + sizeof(T)) - 1;
     std::vector<FILE *> nodes;
+    tree_stats op_stats;
     std::vector<bool> is_leaf;
     std::shared_mutex print_mutex, print_small_mutex;
     std::shared_mutex new_mutex;
@@ -66,6 +75,8 @@ private:
         size_t state;
         rewind(nodes[id]);
         state = fread(node, sizeof(btree_node), 1, nodes[id]);
+        op_stats.add(tree_stats::PAGE_READS);
+        op_stats.add(tree_stats::BYTES_READ, sizeof(btree_node));
         if (state != 1)
         {
             fprintf(stderr, "btree: I/O error in get_node\n");
@@ -80,6 +91,8 @@ private:
         size_t state;
         rewind(nodes[id]);
         state = fwrite(node, sizeof(btree_node), 1, nodes[id]);
+        op_stats.add(tree_stats::PAGE_WRITES);
+        op_stats.add(tree_stats::BYTES_WRITTEN, sizeof(btree_node));
         delete node;
 
         if (state != 1)
@@ -117,6 +130,8 @@ private:
         size_t state;
         rewind(nodes[id]);
         state = fread(data, sizeof(btree_data), 1, nodes[id]);
+        op_stats.add(tree_stats::PAGE_READS);
+        op_stats.add(tree_stats::BYTES_READ, sizeof(btree_data));
         if (state != 1)
         {
             fprintf(stderr, "btree: I/O error in get_data\n");
@@ -130,6 +145,8 @@ private:
         size_t state;
         rewind(nodes[id]);
         state = fwrite(data, sizeof(btree_data), 1, nodes[id]);
+        op_stats.add(tree_stats::PAGE_WRITES);
+        op_stats.add(tree_stats::BYTES_WRITTEN, sizeof(btree_data));
 
         delete data;
 
@@ -358,6 +375,7 @@ private:
     // must add lock before call
     void split_data(btree_data *data_r, btree_node *node_fa)
     {
+        op_stats.add(tree_stats::SPLITS);
         btree_data *data_l = new btree_data;
         memcpy(data_l->key, data_r->key, data_cap / 2 * sizeof(Key));
         memcpy(data_l->val, data_r->val, data_cap / 2 * sizeof(T));
@@ -373,6 +391,7 @@ private:
     // must add lock before call
     void split_node(btree_node *node_r, btree_node *node_fa)
     {
+        op_stats.add(tree_stats::SPLITS);
         btree_node *node_l = new btree_node;
         memcpy(node_l->key, node_r->key, (node_cap / 2 - 1) * sizeof(Key));
         memcpy(node_l->nxt, node_r->nxt, node_cap / 2 * sizeof(uint32_t));
@@ -406,8 +425,8 @@ private:
     }
 };
 
-template <typename Key, typename T>
-buffertree_wrapper<Key, T>::buffertree_wrapper()
+template <typename Key, typename T, size_t PageBytes>
+buffertree_wrapper<Key, T, PageBytes>::buffertree_wrapper()
 {
     btree_node *node = new btree_node;
     node->nxt[0] = 1;
@@ -421,18 +440,29 @@ buffertree_wrapper<Key, T>::buffertree_wrapper()
     root_id = 0;
 }
 
-template <typename Key, typename T>
-buffertree_wrapper<Key, T>::~buffertree_wrapper()
+template <typename Key, typename T, size_t PageBytes>
+buffertree_wrapper<Key, T, PageBytes>::~buffertree_wrapper()
 {
     for (auto node : nodes)
     {
         fclose(node);
     }
+    if (tree_stats::dump_at_exit())
+    {
+        stats().print(stderr, "buffertree");
+    }
+}
+
+template <typename Key, typename T, size_t PageBytes>
+tree_stats::snapshot buffertree_wrapper<Key, T, PageBytes>::stats()
+{
+    return op_stats.read();
 }
 
-template <typename Key, typename T>
-bool buffertree_wrapper<Key, T>::find(const char *key, size_t key_sz, char *value_out)
+template <typename Key, typename T, size_t PageBytes>
+bool buffertree_wrapper<Key, T, PageBytes>::find(const char *key, size_t key_sz, char *value_out)
 {
+    tree_stats::timer timer(op_stats, tree_stats::FIND);
 
     Key k = *reinterpret_cast<Key *>(const_cast<char *>(key));
     // printf("find %lld\n", k);
@@ -465,9 +495,10 @@ bool buffertree_wrapper<Key, T>::find(const char *key, size_t key_sz, char *valu
     return true;
 }
 
-template <typename Key, typename T>
-bool buffertree_wrapper<Key, T>::insert(const char *key, size_t key_sz, const char *value, size_t value_sz)
+template <typename Key, typename T, size_t PageBytes>
+bool buffertree_wrapper<Key, T, PageBytes>::insert(const char *key, size_t key_sz, const char *value, size_t value_sz)
 {
+    tree_stats::timer timer(op_stats, tree_stats::INSERT);
     Key k = *reinterpret_cast<Key *>(const_cast<char *>(key));
     T v = *reinterpret_cast<T *>(const_cast<char *>(value));
     // printf("=======insert========%12lld %12lld\n", k, v);
@@ -502,9 +533,10 @@ bool buffertree_wrapper<Key, T>::insert(const char *key, size_t key_sz, const ch
 }
 
 // clear node[cur_id]'s buffer
-template <typename Key, typename T>
-void buffertree_wrapper<Key, T>::spill(uint32_t cur_id, btree_node *pnode)
+template <typename Key, typename T, size_t PageBytes>
+void buffertree_wrapper<Key, T, PageBytes>::spill(uint32_t cur_id, btree_node *pnode)
 {
+    op_stats.add(tree_stats::SPILLS);
     while (pnode->num_buf > 0)
     {
         Key k = pnode->buf_key[pnode->num_buf - 1];
@@ -544,9 +576,10 @@ void buffertree_wrapper<Key, T>::spill(uint32_t cur_id, btree_node *pnode)
     }
 }
 
-template <typename Key, typename T>
-bool buffertree_wrapper<Key, T>::update(const char *key, size_t key_sz, const char *value, size_t value_sz)
+template <typename Key, typename T, size_t PageBytes>
+bool buffertree_wrapper<Key, T, PageBytes>::update(const char *key, size_t key_sz, const char *value, size_t value_sz)
 {
+    tree_stats::timer timer(op_stats, tree_stats::UPDATE);
     // printf("==update==\n");
     Key k = *reinterpret_cast<Key *>(const_cast<char *>(key));
     T v = *reinterpret_cast<T *>(const_cast<char *>(value));
@@ -567,9 +600,10 @@ bool buffertree_wrapper<Key, T>::update(const char *key, size_t key_sz, const ch
     return true;
 }
 
-template <typename Key, typename T>
-bool buffertree_wrapper<Key, T>::remove(const char *key, size_t key_sz)
+template <typename Key, typename T, size_t PageBytes>
+bool buffertree_wrapper<Key, T, PageBytes>::remove(const char *key, size_t key_sz)
 {
+    tree_stats::timer timer(op_stats, tree_stats::REMOVE);
     // printf("==remove==\n");
     Key k = *reinterpret_cast<Key *>(const_cast<char *>(key));
     int cur_id = root_id;
@@ -588,9 +622,10 @@ bool buffertree_wrapper<Key, T>::remove(const char *key, size_t key_sz)
     return true;
 }
 
-template <typename Key, typename T>
-int buffertree_wrapper<Key, T>::scan(const char *key, size_t key_sz, int scan_sz, char *&values_out)
+template <typename Key, typename T, size_t PageBytes>
+int buffertree_wrapper<Key, T, PageBytes>::scan(const char *key, size_t key_sz, int scan_sz, char *&values_out)
 {
+    tree_stats::timer timer(op_stats, tree_stats::SCAN);
     std::shared_lock lock(mutex_);
     return scan_sz;
 }
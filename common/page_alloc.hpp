@@ -0,0 +1,276 @@
+#ifndef __PAGE_ALLOC_HPP__
+#define __PAGE_ALLOC_HPP__
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+// Slab allocator for page-sized buffers: powers of two from MIN_BYTES to
+// CHUNK_BYTES, each aligned to its size, so any of them can be handed to
+// O_DIRECT I/O. Blocks are carved from 2 MB chunks taken from mmap and never
+// given back. Every thread keeps a free list per size and only takes the
+// lock of the shared depot to move a batch of blocks in or out of it, so
+// threads allocating and freeing pages do not contend in malloc. A block may
+// be freed by another thread than the one that allocated it.
+//
+// With use_huge_pages() chunks come from the reserved huge pages if there are
+// any, and from transparent huge pages otherwise.
+class page_alloc
+{
+public:
+    static constexpr size_t MIN_BYTES = 512;
+    static constexpr size_t CHUNK_BYTES = 2 << 20;
+
+    static void *alloc(size_t sz)
+    {
+        unsigned c = size_class(sz);
+        cache &l = touch();
+        if (l.head[c] == nullptr)
+        {
+            if (l.gone)
+            {
+                uint32_t n;
+                block *b = take(c, n);
+                if (n > 1)
+                {
+                    give(c, b->next, n - 1);
+                }
+                return b;
+            }
+            refill(c);
+        }
+        block *b = l.head[c];
+        l.head[c] = b->next;
+        --l.count[c];
+        return b;
+    }
+
+    static void free(void *p, size_t sz)
+    {
+        if (p == nullptr)
+        {
+            return;
+        }
+        unsigned c = size_class(sz);
+        cache &l = touch();
+        block *b = static_cast<block *>(p);
+        if (l.gone)
+        {
+            b->next = nullptr;
+            give(c, b, 1);
+            return;
+        }
+        b->next = l.head[c];
+        l.head[c] = b;
+        if (++l.count[c] >= 2 * BATCH)
+        {
+            give(c, detach(c, BATCH), BATCH);
+        }
+    }
+
+    // chunks taken from now on are backed by huge pages
+    static void use_huge_pages(bool on)
+    {
+        huge.store(on, std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr unsigned CLASSES = 13; // 512 B .. 2 MB
+    static constexpr uint32_t BATCH = 32;   // blocks moved between a thread and the depot at once
+
+    // a free block; the first of a batch in the depot also links the next batch
+    struct block
+    {
+        block *next;
+        block *next_batch;
+        uint32_t count; // blocks in the batch
+    };
+
+    struct cache
+    {
+        block *head[CLASSES];
+        uint32_t count[CLASSES];
+        bool gone; // the thread is exiting, its frees go to the depot
+    };
+
+    struct depot
+    {
+        std::mutex mutex;
+        block *batches = nullptr;
+    };
+
+    // gives the blocks of a thread back when it exits
+    struct reaper
+    {
+        ~reaper()
+        {
+            cache &l = local;
+            for (unsigned c = 0; c < CLASSES; ++c)
+            {
+                while (l.count[c] > 0)
+                {
+                    uint32_t n = std::min(l.count[c], BATCH);
+                    give(c, detach(c, n), n);
+                }
+            }
+            l.gone = true;
+        }
+    };
+
+    static inline thread_local cache local;
+    static inline std::atomic<bool> huge{false};
+
+    // the cache of the calling thread; the reaper is made on the first call,
+    // so a thread that only frees pages also gives them back on exit
+    static cache &touch()
+    {
+        static thread_local reaper r;
+        (void)r;
+        return local;
+    }
+
+    static unsigned size_class(size_t sz)
+    {
+        if (sz < MIN_BYTES || sz > CHUNK_BYTES || (sz & (sz - 1)) != 0)
+        {
+            fprintf(stderr, "page_alloc: unsupported size %zu\n", sz);
+            abort();
+        }
+        return __builtin_ctzll(sz) - __builtin_ctzll(MIN_BYTES);
+    }
+
+    // never destroyed, so a thread exiting late still finds it
+    static depot &shared(unsigned c)
+    {
+        static depot *depots = new depot[CLASSES];
+        return depots[c];
+    }
+
+    // the first n blocks of the thread's list of class c
+    static block *detach(unsigned c, uint32_t n)
+    {
+        cache &l = local;
+        block *first = l.head[c], *last = first;
+        for (uint32_t i = 1; i < n; ++i)
+        {
+            last = last->next;
+        }
+        l.head[c] = last->next;
+        l.count[c] -= n;
+        last->next = nullptr;
+        return first;
+    }
+
+    static void give(unsigned c, block *first, uint32_t n)
+    {
+        depot &d = shared(c);
+        first->count = n;
+        std::unique_lock lock(d.mutex);
+        first->next_batch = d.batches;
+        d.batches = first;
+    }
+
+    // n > 0 linked blocks: a batch of the depot, or the first batch of a
+    // fresh chunk whose other batches go to the depot
+    static block *take(unsigned c, uint32_t &n)
+    {
+        depot &d = shared(c);
+        {
+            std::unique_lock lock(d.mutex);
+            if (block *b = d.batches)
+            {
+                d.batches = b->next_batch;
+                n = b->count;
+                return b;
+            }
+        }
+        size_t sz = MIN_BYTES << c;
+        char *chunk = map_chunk();
+        uint32_t per_chunk = CHUNK_BYTES / sz;
+        block *mine = nullptr;
+        for (uint32_t i = 0; i < per_chunk; i += BATCH)
+        {
+            uint32_t m = std::min(BATCH, per_chunk - i);
+            block *first = reinterpret_cast<block *>(chunk + i * sz);
+            for (uint32_t j = 0; j < m; ++j)
+            {
+                block *b = reinterpret_cast<block *>(chunk + (i + j) * sz);
+                b->next = j + 1 < m ? reinterpret_cast<block *>(chunk + (i + j + 1) * sz) : nullptr;
+            }
+            if (mine == nullptr)
+            {
+                mine = first;
+                n = m;
+            }
+            else
+            {
+                give(c, first, m);
+            }
+        }
+        return mine;
+    }
+
+    static void refill(unsigned c)
+    {
+        cache &l = local;
+        uint32_t n;
+        l.head[c] = take(c, n);
+        l.count[c] = n;
+    }
+
+    static char *map_chunk()
+    {
+        if (huge.load(std::memory_order_relaxed))
+        {
+            void *p = mmap(nullptr, CHUNK_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (p != MAP_FAILED)
+            {
+                return static_cast<char *>(p);
+            }
+        }
+        // twice the size, trimmed to a chunk aligned to its size
+        void *p = mmap(nullptr, 2 * CHUNK_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+        {
+            fprintf(stderr, "page_alloc: out of memory\n");
+            abort();
+        }
+        uintptr_t base = reinterpret_cast<uintptr_t>(p);
+        uintptr_t start = (base + CHUNK_BYTES - 1) & ~(uintptr_t)(CHUNK_BYTES - 1);
+        if (start > base)
+        {
+            munmap(p, start - base);
+        }
+        if (start + CHUNK_BYTES < base + 2 * CHUNK_BYTES)
+        {
+            munmap(reinterpret_cast<void *>(start + CHUNK_BYTES), base + 2 * CHUNK_BYTES - start - CHUNK_BYTES);
+        }
+        if (huge.load(std::memory_order_relaxed))
+        {
+            madvise(reinterpret_cast<void *>(start), CHUNK_BYTES, MADV_HUGEPAGE);
+        }
+        return reinterpret_cast<char *>(start);
+    }
+};
+
+// Base of a page struct of Bytes: new and delete take its buffer from the
+// slab, not from malloc.
+template <size_t Bytes>
+struct slab_allocated
+{
+    static void *operator new(size_t)
+    {
+        return page_alloc::alloc(Bytes);
+    }
+    static void operator delete(void *p, size_t)
+    {
+        page_alloc::free(p, Bytes);
+    }
+};
+
+#endif
@@ -0,0 +1,228 @@
+#ifndef __TREE_STATS_HPP__
+#define __TREE_STATS_HPP__
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+// I/O counters and per-operation latency histograms of a tree engine.
+// Each thread adds to its own shard, picked once per thread, so recording is
+// a relaxed add on a cache line other threads rarely touch; read() sums the
+// shards. Set TREE_STATS=1 to have an engine print them at teardown.
+class tree_stats
+{
+public:
+    enum counter
+    {
+        PAGE_READS,
+        PAGE_WRITES,
+        BYTES_READ,
+        BYTES_WRITTEN,
+        SPLITS,
+        MERGES,
+        SPILLS,
+        RUNS_PROBED,
+        BLOOM_PROBES,
+        BLOOM_FALSE_POSITIVES,
+        CACHE_HITS,
+        CACHE_MISSES,
+        HOT_HITS,
+        HOT_MISSES,
+        FLUSHES,
+        DIRTY_EVICTIONS,
+        NUM_COUNTERS
+    };
+
+    enum op
+    {
+        FIND,
+        INSERT,
+        UPDATE,
+        REMOVE,
+        SCAN,
+        NUM_OPS
+    };
+
+    // bucket b > 0 counts latencies in [2^(b-1), 2^b) ns, the last one all above
+    static constexpr unsigned BUCKETS = 40;
+
+    struct snapshot
+    {
+        uint64_t counters[NUM_COUNTERS] = {};
+        uint64_t hist[NUM_OPS][BUCKETS] = {};
+        uint64_t total_ns[NUM_OPS] = {};
+
+        uint64_t ops(op o) const
+        {
+            uint64_t n = 0;
+            for (unsigned b = 0; b < BUCKETS; ++b)
+            {
+                n += hist[o][b];
+            }
+            return n;
+        }
+
+        // upper bound in ns of the bucket holding quantile q of op o
+        uint64_t percentile(op o, double q) const
+        {
+            uint64_t n = ops(o), seen = 0;
+            for (unsigned b = 0; b < BUCKETS; ++b)
+            {
+                seen += hist[o][b];
+                if (n > 0 && seen >= q * n)
+                {
+                    return b == 0 ? 0 : 1ull << b;
+                }
+            }
+            return 0;
+        }
+
+        void print(FILE *out, const char *name) const
+        {
+            static const char *counter_names[NUM_COUNTERS] = {
+                "page reads", "page writes", "bytes read", "bytes written", "splits", "merges", "spills",
+                "runs probed", "bloom probes", "bloom false positives", "cache hits", "cache misses",
+                "hot key hits", "hot key misses", "background flushes", "dirty evictions"};
+            static const char *op_names[NUM_OPS] = {"find", "insert", "update", "remove", "scan"};
+            fprintf(out, "%s stats:\n", name);
+            for (unsigned c = 0; c < NUM_COUNTERS; ++c)
+            {
+                if (counters[c] > 0)
+                {
+                    fprintf(out, "  %-22s %llu\n", counter_names[c], (unsigned long long)counters[c]);
+                }
+            }
+            if (uint64_t lookups = counters[HOT_HITS] + counters[HOT_MISSES])
+            {
+                fprintf(out, "  %-22s %.2f%%\n", "hot key hit rate", 100.0 * counters[HOT_HITS] / lookups);
+            }
+            for (unsigned o = 0; o < NUM_OPS; ++o)
+            {
+                uint64_t n = ops(op(o));
+                if (n == 0)
+                {
+                    continue;
+                }
+                fprintf(out, "  %-6s %10llu ops  avg %8.2f us  p50 < %llu us  p99 < %llu us  p99.9 < %llu us\n",
+                        op_names[o], (unsigned long long)n, total_ns[o] / 1000.0 / n,
+                        (unsigned long long)(percentile(op(o), 0.5) + 999) / 1000,
+                        (unsigned long long)(percentile(op(o), 0.99) + 999) / 1000,
+                        (unsigned long long)(percentile(op(o), 0.999) + 999) / 1000);
+            }
+        }
+    };
+
+    // measures one operation from construction to destruction
+    class timer
+    {
+    public:
+        timer(tree_stats &stats, op o) : stats(stats), o(o), start(std::chrono::steady_clock::now())
+        {
+        }
+        ~timer()
+        {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+            stats.record(o, ns.count());
+        }
+        timer(const timer &) = delete;
+        timer &operator=(const timer &) = delete;
+
+    private:
+        tree_stats &stats;
+        op o;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    tree_stats() : shards(new shard[NUM_SHARDS]())
+    {
+    }
+
+    void add(counter c, uint64_t n = 1)
+    {
+        local().counters[c].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    void record(op o, uint64_t ns)
+    {
+        shard &s = local();
+        unsigned b = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+        s.hist[o][b < BUCKETS ? b : BUCKETS - 1].fetch_add(1, std::memory_order_relaxed);
+        s.total_ns[o].fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    snapshot read() const
+    {
+        snapshot r;
+        for (size_t i = 0; i < NUM_SHARDS; ++i)
+        {
+            const shard &s = shards[i];
+            for (unsigned c = 0; c < NUM_COUNTERS; ++c)
+            {
+                r.counters[c] += s.counters[c].load(std::memory_order_relaxed);
+            }
+            for (unsigned o = 0; o < NUM_OPS; ++o)
+            {
+                for (unsigned b = 0; b < BUCKETS; ++b)
+                {
+                    r.hist[o][b] += s.hist[o][b].load(std::memory_order_relaxed);
+                }
+                r.total_ns[o] += s.total_ns[o].load(std::memory_order_relaxed);
+            }
+        }
+        return r;
+    }
+
+    void reset()
+    {
+        for (size_t i = 0; i < NUM_SHARDS; ++i)
+        {
+            shard &s = shards[i];
+            for (auto &c : s.counters)
+            {
+                c.store(0, std::memory_order_relaxed);
+            }
+            for (auto &h : s.hist)
+            {
+                for (auto &b : h)
+                {
+                    b.store(0, std::memory_order_relaxed);
+                }
+            }
+            for (auto &t : s.total_ns)
+            {
+                t.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // whether an engine should print its stats at teardown
+    static bool dump_at_exit()
+    {
+        const char *s = getenv("TREE_STATS");
+        return s != nullptr && atoi(s) != 0;
+    }
+
+private:
+    static constexpr size_t NUM_SHARDS = 64;
+
+    struct alignas(64) shard
+    {
+        std::atomic<uint64_t> counters[NUM_COUNTERS];
+        std::atomic<uint64_t> hist[NUM_OPS][BUCKETS];
+        std::atomic<uint64_t> total_ns[NUM_OPS];
+    };
+
+    std::unique_ptr<shard[]> shards;
+
+    shard &local()
+    {
+        static std::atomic<unsigned> next_slot{0};
+        thread_local unsigned slot = next_slot.fetch_add(1, std::memory_order_relaxed);
+        return shards[slot % NUM_SHARDS];
+    }
+};
+
+#endif
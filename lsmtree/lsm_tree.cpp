@@ -2,6 +2,7 @@
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <unistd.h>
 
 #include "lsm_tree.h"
 #include "merge.h"
@@ -71,11 +72,15 @@ void LSMTree::merge_down(vector<Level>::iterator current) {
      * run in the next level
      */
 
+    stats.add(tree_stats::MERGES);
+
     for (auto& run : current->runs) {
         merge_ctx.add(run.map_read(), run.size);
+        stats.add(tree_stats::PAGE_READS, (run.size * sizeof(entry_t) + getpagesize() - 1) / getpagesize());
+        stats.add(tree_stats::BYTES_READ, run.size * sizeof(entry_t));
     }
 
-    next->runs.emplace_front(next->max_run_size, bf_bits_per_entry);
+    next->runs.emplace_front(next->max_run_size, bf_bits_per_entry, &stats);
     next->runs.front().map_write();
 
     while (!merge_ctx.done()) {
@@ -121,7 +126,7 @@ void LSMTree::put(KEY_t key, VAL_t val) {
      * Flush the buffer to level 0
      */
 
-    levels.front().runs.emplace_front(levels.front().max_run_size, bf_bits_per_entry);
+    levels.front().runs.emplace_front(levels.front().max_run_size, bf_bits_per_entry, &stats);
     levels.front().runs.front().map_write();
 
     for (const auto& entry : buffer.entries) {
@@ -165,6 +170,7 @@ void LSMTree::get(KEY_t key) {
     buffer_val = buffer.get(key);
 
     if (buffer_val != nullptr) {
+        stats.add(tree_stats::CACHE_HITS);
         //if (*buffer_val != VAL_TOMBSTONE) cout << *buffer_val;
         //cout << endl;
         if (*buffer_val != VAL_TOMBSTONE) res = *buffer_val;
@@ -177,6 +183,7 @@ void LSMTree::get(KEY_t key) {
      * Search runs
      */
 
+    stats.add(tree_stats::CACHE_MISSES);
     counter = 0;
     latest_run = -1;
 
@@ -191,7 +198,11 @@ void LSMTree::get(KEY_t key) {
             // Stop search if we discovered a key in another run, or
             // if there are no more runs to search
             return;
-        } else if ((current_val = run->get(key)) == nullptr) {
+        }
+
+        stats.add(tree_stats::RUNS_PROBED);
+
+        if ((current_val = run->get(key)) == nullptr) {
             // Couldn't find the key in the current run, so we need
             // to keep searching.
             search();
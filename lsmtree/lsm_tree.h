@@ -5,6 +5,7 @@
 #include "spin_lock.h"
 #include "types.h"
 #include "worker_pool.h"
+#include "../common/tree_stats.hpp"
 
 class LSMTree {
     Buffer buffer;
@@ -14,6 +15,7 @@ class LSMTree {
     Run * get_run(int);
     void merge_down(vector<Level>::iterator);
 public:
+    tree_stats stats;
     LSMTree(int, int, int, int, float);
     void put(KEY_t, VAL_t);
     void get(KEY_t);
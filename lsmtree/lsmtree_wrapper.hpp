@@ -38,7 +38,13 @@ public:
 
     //void print_stat(leveldb::DB* db_, bool print_sst=false);
 
+    // run probes, bloom filter outcomes, page I/O and operation latencies so far
+    tree_stats::snapshot stats();
+
 private:
+    // the put of insert and update, timed by the caller
+    bool put(const char* key, size_t key_sz, const char* value, size_t value_sz);
+
     LSMTree* lsm;
 };
 
@@ -62,11 +68,19 @@ lsmtree_wrapper::~lsmtree_wrapper(){
     // TODO(jhpark) : pass parameters for leveldb statistics
     //print_stat(db);
     //delete lsm;
+    if (tree_stats::dump_at_exit()) {
+        stats().print(stderr, "lsmtree");
+    }
     delete lsm;
 }
 
+tree_stats::snapshot lsmtree_wrapper::stats() {
+    return lsm->stats.read();
+}
+
 bool lsmtree_wrapper::find(const char* key, size_t key_sz, char* value_out)
 {
+    tree_stats::timer timer(lsm->stats, tree_stats::FIND);
     // TODO(jhpark): Provide positive/false read statistics
     //std::string str;
     //uint64_t k = __builtin_bswap64(*reinterpret_cast<const uint64_t *>(key));
@@ -81,6 +95,12 @@ bool lsmtree_wrapper::find(const char* key, size_t key_sz, char* value_out)
 
 
 bool lsmtree_wrapper::insert(const char* key, size_t key_sz, const char* value, size_t value_sz)
+{
+    tree_stats::timer timer(lsm->stats, tree_stats::INSERT);
+    return put(key, key_sz, value, value_sz);
+}
+
+bool lsmtree_wrapper::put(const char* key, size_t key_sz, const char* value, size_t value_sz)
 {
     //uint64_t k = __builtin_bswap64(*reinterpret_cast<const uint64_t *>(key));
     //uint64_t v = __builtin_bswap64(*reinterpret_cast<const uint64_t *>(value));
@@ -97,10 +117,12 @@ bool lsmtree_wrapper::insert(const char* key, size_t key_sz, const char* value,
 }
 
 bool lsmtree_wrapper::update(const char* key, size_t key_sz, const char* value, size_t value_sz) {
-  return insert(key, key_sz, value, value_sz);
+    tree_stats::timer timer(lsm->stats, tree_stats::UPDATE);
+    return put(key, key_sz, value, value_sz);
 }
 
 bool lsmtree_wrapper::remove(const char* key, size_t key_sz) {
+    tree_stats::timer timer(lsm->stats, tree_stats::REMOVE);
 
     //uint64_t k = __builtin_bswap64(*reinterpret_cast<const uint64_t *>(key));
     int32_t k = __builtin_bswap32(*reinterpret_cast<const int32_t *>(key));
@@ -112,6 +134,7 @@ bool lsmtree_wrapper::remove(const char* key, size_t key_sz) {
 }
 
 int lsmtree_wrapper::scan(const char* key, size_t key_sz, int scan_sz, char*& values_out) {
+    tree_stats::timer timer(lsm->stats, tree_stats::SCAN);
     // TODO(jhpark): 
     //  - Provide positive/false scan statistics
     //  - Efficient scan algorithms needed
@@ -10,9 +10,10 @@
 
 using namespace std;
 
-Run::Run(long max_size, float bf_bits_per_entry) :
+Run::Run(long max_size, float bf_bits_per_entry, tree_stats *stats) :
          max_size(max_size),
-         bloom_filter(max_size * bf_bits_per_entry)
+         bloom_filter(max_size * bf_bits_per_entry),
+         stats(stats)
 {
     char *tmp_fn;
 
@@ -24,6 +25,7 @@ Run::Run(long max_size, float bf_bits_per_entry) :
 
     mapping = nullptr;
     mapping_fd = -1;
+    mapping_writable = false;
 }
 
 Run::~Run(void) {
@@ -67,6 +69,7 @@ entry_t * Run::map_write(void) {
 
     mapping = (entry_t *)mmap(0, mapping_length, PROT_WRITE, MAP_SHARED, mapping_fd, 0);
     assert(mapping != MAP_FAILED);
+    mapping_writable = true;
 
     return mapping;
 }
@@ -74,12 +77,19 @@ entry_t * Run::map_write(void) {
 void Run::unmap(void) {
     assert(mapping != nullptr);
 
+    if (mapping_writable) {
+        // the entries put since map_write
+        stats->add(tree_stats::PAGE_WRITES, (size * sizeof(entry_t) + getpagesize() - 1) / getpagesize());
+        stats->add(tree_stats::BYTES_WRITTEN, size * sizeof(entry_t));
+    }
+
     munmap(mapping, mapping_length);
     close(mapping_fd);
 
     mapping = nullptr;
     mapping_length = 0;
     mapping_fd = -1;
+    mapping_writable = false;
 }
 
 VAL_t * Run::get(KEY_t key) {
@@ -90,7 +100,13 @@ VAL_t * Run::get(KEY_t key) {
 
     val = nullptr;
 
-    if (key < fence_pointers[0] || key > max_key || !bloom_filter.is_set(key)) {
+    if (key < fence_pointers[0] || key > max_key) {
+        return val;
+    }
+
+    stats->add(tree_stats::BLOOM_PROBES);
+
+    if (!bloom_filter.is_set(key)) {
         return val;
     }
 
@@ -99,6 +115,8 @@ VAL_t * Run::get(KEY_t key) {
     assert(page_index >= 0);
 
     map_read(getpagesize(), page_index * getpagesize());
+    stats->add(tree_stats::PAGE_READS);
+    stats->add(tree_stats::BYTES_READ, getpagesize());
 
     for (i = 0; i < getpagesize() / sizeof(entry_t); i++) {
         if (mapping[i].key == key) {
@@ -109,6 +127,10 @@ VAL_t * Run::get(KEY_t key) {
 
     unmap();
 
+    if (val == nullptr) {
+        stats->add(tree_stats::BLOOM_FALSE_POSITIVES);
+    }
+
     return val;
 }
 
@@ -141,6 +163,8 @@ vector<entry_t> * Run::range(KEY_t start, KEY_t end) {
     assert(subrange_page_start < subrange_page_end);
     num_pages = subrange_page_end - subrange_page_start;
     map_read(num_pages * getpagesize(), subrange_page_start * getpagesize());
+    stats->add(tree_stats::PAGE_READS, num_pages);
+    stats->add(tree_stats::BYTES_READ, num_pages * getpagesize());
 
     num_entries = num_pages * getpagesize() / sizeof(entry_t);
     subrange->reserve(num_entries);
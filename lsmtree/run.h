@@ -2,6 +2,7 @@
 
 #include "types.h"
 #include "bloom_filter.h"
+#include "../common/tree_stats.hpp"
 
 #define TMP_FILE_PATTERN "/tmp/lsm-XXXXXX"
 
@@ -14,11 +15,13 @@ class Run {
     entry_t *mapping;
     size_t mapping_length;
     int mapping_fd;
+    bool mapping_writable;
+    tree_stats *stats;
     long file_size() {return max_size * sizeof(entry_t);}
 public:
     long size, max_size;
     string tmp_file;
-    Run(long, float);
+    Run(long, float, tree_stats *);
     ~Run(void);
     entry_t * map_read(size_t, off_t);
     entry_t * map_read(void);
@@ -0,0 +1,171 @@
+#include "tree_api.hpp"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+// Fills a btree from several threads, then removes all but every 16th key
+// from several threads while a reader finds the survivors and scans, and
+// empties it; a few rounds over. Merged pages are retired while optimistic
+// readers may still be on them, so wrong values, unsorted scans or a crash
+// point at reclamation. Freed pages are taken again by the next round, so
+// the page files must not grow after the first. The tree is configured by
+// the BTREE_* variables of the environment and kept in ./btree.
+
+static const size_t NUM_KEYS = 100000;
+static const int NUM_THREADS = 3;
+static const int NUM_ROUNDS = 5;
+
+// bytes taken by the page files
+static off_t page_file_bytes()
+{
+    off_t total = 0;
+    struct stat st;
+    for (int i = 0; stat(("./btree/btree_pages_" + std::to_string(i)).c_str(), &st) == 0; ++i)
+    {
+        total += st.st_size;
+    }
+    return total;
+}
+
+// keys of a scan must ascend
+static bool scan_sorted(const char *out, int count)
+{
+    for (int i = 1; i < count; ++i)
+    {
+        if (*reinterpret_cast<const uint64_t *>(out + 16 * i) <= *reinterpret_cast<const uint64_t *>(out + 16 * (i - 1)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main()
+{
+    tree_options_t opt;
+    tree_api *t = create_tree(opt);
+    if (t == nullptr)
+    {
+        fprintf(stderr, "btree_churn_test: no tree for this configuration\n");
+        return 1;
+    }
+    std::vector<uint64_t> keys(NUM_KEYS);
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        keys[i] = i * 7 + 1;
+    }
+    std::mt19937 rng(3);
+    std::shuffle(keys.begin(), keys.end(), rng);
+
+    std::atomic<int> errs{0};
+    off_t first_bytes = 0;
+    for (int round = 0; round < NUM_ROUNDS; ++round)
+    {
+        std::vector<std::thread> writers;
+        for (int w = 0; w < NUM_THREADS; ++w)
+        {
+            writers.emplace_back([&, w] {
+                for (size_t i = w; i < keys.size(); i += NUM_THREADS)
+                {
+                    uint64_t k = keys[i], v = k + round;
+                    if (!t->insert(reinterpret_cast<char *>(&k), 8, reinterpret_cast<char *>(&v), 8))
+                    {
+                        ++errs;
+                    }
+                }
+            });
+        }
+        for (auto &w : writers)
+        {
+            w.join();
+        }
+        writers.clear();
+
+        std::atomic<bool> stop{false};
+        std::thread reader([&] {
+            std::mt19937 r(9);
+            while (!stop.load())
+            {
+                uint64_t k = keys[r() % (keys.size() / 16) * 16], v;
+                if (!t->find(reinterpret_cast<char *>(&k), 8, reinterpret_cast<char *>(&v)) || v != k + round)
+                {
+                    ++errs;
+                }
+                uint64_t from = r() % (keys.size() * 7);
+                char *out;
+                int count = t->scan(reinterpret_cast<char *>(&from), 8, 50, out);
+                if (!scan_sorted(out, count))
+                {
+                    ++errs;
+                }
+            }
+        });
+        for (int w = 0; w < NUM_THREADS; ++w)
+        {
+            writers.emplace_back([&, w] {
+                for (size_t i = w; i < keys.size(); i += NUM_THREADS)
+                {
+                    uint64_t k = keys[i];
+                    if (i % 16 != 0 && !t->remove(reinterpret_cast<char *>(&k), 8))
+                    {
+                        ++errs;
+                    }
+                }
+            });
+        }
+        for (auto &w : writers)
+        {
+            w.join();
+        }
+        stop.store(true);
+        reader.join();
+
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            uint64_t k = keys[i], v;
+            bool found = t->find(reinterpret_cast<char *>(&k), 8, reinterpret_cast<char *>(&v));
+            if (i % 16 == 0 ? !found || v != k + round : found)
+            {
+                ++errs;
+            }
+        }
+        for (size_t i = 0; i < keys.size(); i += 16)
+        {
+            uint64_t k = keys[i];
+            if (!t->remove(reinterpret_cast<char *>(&k), 8))
+            {
+                ++errs;
+            }
+        }
+        char *out;
+        uint64_t from = 0;
+        if (t->scan(reinterpret_cast<char *>(&from), 8, 10, out) != 0)
+        {
+            ++errs;
+        }
+
+        off_t bytes = page_file_bytes();
+        if (round == 0)
+        {
+            first_bytes = bytes;
+        }
+        else if (bytes > first_bytes)
+        {
+            fprintf(stderr, "round %d: page files grew from %lld to %lld bytes\n", round, (long long)first_bytes,
+                    (long long)bytes);
+            ++errs;
+        }
+        printf("round %d: %d errors\n", round, errs.load());
+    }
+    delete t;
+    return errs != 0;
+}
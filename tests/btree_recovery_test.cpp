@@ -0,0 +1,216 @@
+#include "tree_api.hpp"
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+// Reopens a btree closed by this process, and one left behind by a writer
+// killed with SIGKILL, and checks what each holds. The tree is configured by
+// the BTREE_* variables of the environment and kept in ./btree. The killed
+// writer is only run with shadow paging or the log, without them a tree can
+// only be reopened after it was closed.
+
+static const size_t NUM_KEYS = 50000;
+
+static uint64_t fill_value(uint64_t k)
+{
+    return k + 5;
+}
+
+static uint64_t update_value(uint64_t k)
+{
+    return k * 3 + 1;
+}
+
+static bool env_set(const char *name)
+{
+    const char *s = getenv(name);
+    return s != nullptr && atoi(s) != 0;
+}
+
+static tree_api *open_tree(bool existing)
+{
+    setenv("BTREE_OPEN_EXISTING", existing ? "1" : "0", 1);
+    tree_options_t opt;
+    tree_api *t = create_tree(opt);
+    if (t == nullptr)
+    {
+        fprintf(stderr, "btree_recovery_test: no tree for this configuration\n");
+        exit(1);
+    }
+    return t;
+}
+
+// the first count keys of a scan from 0 must ascend
+static int scan_errors(tree_api *t)
+{
+    char *out;
+    uint64_t from = 0;
+    int count = t->scan(reinterpret_cast<char *>(&from), 8, 1000, out);
+    int errs = 0;
+    for (int i = 1; i < count; ++i)
+    {
+        if (*reinterpret_cast<uint64_t *>(out + 16 * i) <= *reinterpret_cast<uint64_t *>(out + 16 * (i - 1)))
+        {
+            ++errs;
+        }
+    }
+    return errs;
+}
+
+// fill, update every 2nd key and remove every 5th, close, reopen and check;
+// then insert the removed keys again and check once more after a reopen
+static int closed_tree(const std::vector<uint64_t> &keys)
+{
+    tree_api *t = open_tree(false);
+    for (uint64_t k : keys)
+    {
+        uint64_t v = fill_value(k);
+        t->insert(reinterpret_cast<char *>(&k), 8, reinterpret_cast<char *>(&v), 8);
+    }
+    for (size_t i = 0; i < keys.size(); i += 2)
+    {
+        uint64_t k = keys[i], v = update_value(k);
+        t->update(reinterpret_cast<char *>(&k), 8, reinterpret_cast<char *>(&v), 8);
+    }
+    for (size_t i = 0; i < keys.size(); i += 5)
+    {
+        uint64_t k = keys[i];
+        t->remove(reinterpret_cast<char *>(&k), 8);
+    }
+    delete t;
+
+    int errs = 0;
+    t = open_tree(true);
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        uint64_t k = keys[i], v;
+        bool found = t->find(reinterpret_cast<char *>(&k), 8, reinterpret_cast<char *>(&v));
+        if (i % 5 == 0)
+        {
+            errs += found;
+        }
+        else if (!found || v != (i % 2 == 0 ? update_value(k) : fill_value(k)))
+        {
+            ++errs;
+        }
+    }
+    errs += scan_errors(t);
+    for (size_t i = 0; i < keys.size(); i += 5)
+    {
+        uint64_t k = keys[i], v = fill_value(k);
+        t->insert(reinterpret_cast<char *>(&k), 8, reinterpret_cast<char *>(&v), 8);
+    }
+    delete t;
+
+    t = open_tree(true);
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        uint64_t k = keys[i], v;
+        uint64_t want = i % 5 == 0 || i % 2 != 0 ? fill_value(k) : update_value(k);
+        if (!t->find(reinterpret_cast<char *>(&k), 8, reinterpret_cast<char *>(&v)) || v != want)
+        {
+            ++errs;
+        }
+    }
+    delete t;
+    printf("closed tree: %d errors\n", errs);
+    return errs;
+}
+
+// a writer inserts the keys in order and reports each one acknowledged; it
+// is killed half way. The reopened tree must hold a prefix of the keys, one
+// that covers every acknowledged key when the log is on
+static int killed_writer(const std::vector<uint64_t> &keys)
+{
+    int pipe_fd[2];
+    if (pipe(pipe_fd) != 0)
+    {
+        perror("pipe");
+        return 1;
+    }
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(pipe_fd[0]);
+        tree_api *t = open_tree(false);
+        for (uint32_t i = 0; i < keys.size(); ++i)
+        {
+            uint64_t k = keys[i], v = fill_value(k);
+            t->insert(reinterpret_cast<char *>(&k), 8, reinterpret_cast<char *>(&v), 8);
+            if (write(pipe_fd[1], &i, sizeof(i)) != sizeof(i))
+            {
+                _exit(1);
+            }
+        }
+        _exit(0);
+    }
+    close(pipe_fd[1]);
+    int64_t acked = -1;
+    uint32_t i;
+    while (acked + 1 < (int64_t)keys.size() / 2 && read(pipe_fd[0], &i, sizeof(i)) == sizeof(i))
+    {
+        acked = i;
+    }
+    kill(pid, SIGKILL);
+    while (read(pipe_fd[0], &i, sizeof(i)) == sizeof(i))
+    {
+        acked = i;
+    }
+    close(pipe_fd[0]);
+    waitpid(pid, nullptr, 0);
+
+    int errs = 0;
+    tree_api *t = open_tree(true);
+    size_t held = 0;
+    while (held < keys.size())
+    {
+        uint64_t k = keys[held], v;
+        if (!t->find(reinterpret_cast<char *>(&k), 8, reinterpret_cast<char *>(&v)))
+        {
+            break;
+        }
+        errs += v != fill_value(k);
+        ++held;
+    }
+    for (size_t j = held; j < keys.size(); ++j)
+    {
+        uint64_t k = keys[j], v;
+        errs += t->find(reinterpret_cast<char *>(&k), 8, reinterpret_cast<char *>(&v));
+    }
+    if (env_set("BTREE_WAL") && (int64_t)held < acked + 1)
+    {
+        errs += acked + 1 - held;
+    }
+    errs += scan_errors(t);
+    delete t;
+    printf("killed writer: %lld acknowledged, %zu held, %d errors\n", (long long)acked + 1, held, errs);
+    return errs;
+}
+
+int main()
+{
+    std::vector<uint64_t> keys(NUM_KEYS);
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        keys[i] = i * 7 + 3;
+    }
+    std::mt19937 rng(5);
+    std::shuffle(keys.begin(), keys.end(), rng);
+
+    int errs = 0;
+    // first, so the writer is not forked from a process holding a tree
+    if (env_set("BTREE_WAL") || env_set("BTREE_SHADOW_PAGING"))
+    {
+        errs += killed_writer(keys);
+    }
+    errs += closed_tree(keys);
+    return errs != 0;
+}